@@ -2,10 +2,45 @@
 // UI: rlutil.h (colors, locate, cls)
 // Features:
 // - Mode A: List draw (manual input / file load) + no-repeat + reset + status + save result
-// - Mode B: Range draw (1..N) + optional no-repeat pool + reset + status
-// Build macOS/Linux:   g++ draw.cpp -std=c++17 -O2 -o draw
-// Run macOS/Linux:     ./draw
-// Build Windows(MinGW): g++ draw.cpp -std=c++17 -O2 -o draw.exe
+// - Mode B: Range draw (1..N) + optional no-repeat pool + reset + status + save result
+// - Export: CSV / JSON Lines / length-prefixed binary, full or append-only
+// - Write-ahead journal (draw.journal): every state change is appended + synced,
+//   and replayed on the next start if the program did not exit normally
+// - Session snapshot (draw.snapshot): saved on exit (asking first before it
+//   replaces one this run didn't resume from), restored with --resume; mode A
+//   stays in the mapped file until it is first used
+// - --mmap-state PREFIX: mode B pool/history live in memory-mapped files
+//   (PREFIX.pool / PREFIX.hist, POSIX only), msync'd every --msync-every draws
+// - Unlimited undo / redo of draws, loads and resets in both modes
+// - Time travel: the pool before any past draw (menus, or --pool-at K headless)
+// - Mode B cooldown: with no-repeat off, numbers from the last W draws sit out
+// - Bulk k-of-N lottery tickets streamed to a file (bitmask Floyd sampler, all cores)
+// - Mode B k-subset draws as one uniform rank in [0, C(N,k)), decoded by the
+//   combinatorial number system (128-bit or bignum); the rank is verifiable
+// - Hash-indexed "was X drawn, and when?" lookups for names and numbers
+// - --registry PREFIX: winners from every session in an append-only log with an
+//   on-disk hash index; mode A leaves past winners out when loading names, or
+//   with --fair-halflife DAYS draws them with a weight that decays over time
+// - Elimination ("last one standing") draws on a grid that repaints one cell per step
+// - Batch draws: k distinct winners applied as ordinary draws with one journal
+//   commit; large batches are claimed by every core at once, one atomic
+//   fetch-add per winner from a lazily permuted pool (no lock, no pre-shuffle)
+// - Large name files are parsed on every core (sharded dedup while loading)
+// - Mode C: one pool in POSIX shared memory (--shared NAME) that several
+//   draw processes claim from with an atomic cursor, no server needed
+// - --coordinate K --shards ...: exact uniform K winners from a roster split
+//   across worker processes (multivariate hypergeometric split)
+// - Prize-tier event scripts: every tier drawn in one pass, JSON results,
+//   optional staged reveal
+// - Mode D: the mode A roster split into K balanced random teams, optionally
+//   stratified by a group column (name,department), paged view + CSV export;
+//   a rules file adds "not in the same team" pairs and a per-department cap
+// - Stratified quota draws: a fixed quota per group, or K split by group size
+// - --batch MANIFEST: many independent roster draws on a work-stealing pool
+// - --serve SOCKET: the same engines as a local daemon over a Unix socket (Linux)
+// Build macOS/Linux:   g++ draw.cpp -std=c++17 -O2 -pthread -o draw
+// Run macOS/Linux:     ./draw            (--resume / --snapshot PATH / --journal PATH / --no-journal / --seed S)
+// Build Windows(MinGW): g++ draw.cpp -std=c++17 -O2 -pthread -o draw.exe
 // Run Windows:          draw.exe
 
 #include <iostream>
@@ -15,16 +50,47 @@
 #include <random>
 #include <ctime>
 #include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <charconv>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <deque>
+#include <unordered_set>
+#include <sstream>
+#include <string_view>
+#include <unordered_map>
+#include <cmath>
 
 #include "rlutil.h"
 
 #ifdef _WIN32
   #include <windows.h>
+  #include <io.h>
+  #include <fcntl.h>
   static void setup_console_utf8() {
     SetConsoleOutputCP(CP_UTF8);
     SetConsoleCP(CP_UTF8);
   }
 #else
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <sys/socket.h>
+  #include <sys/un.h>
+  #include <sys/wait.h>
+  #include <signal.h>
+  #include <cerrno>
+  #ifdef __linux__
+    #include <sys/epoll.h>
+  #endif
   static void setup_console_utf8() {}
 #endif
 
@@ -129,284 +195,4751 @@ static void ui_menu(const vector<string>& items, const string& prompt = "選項"
 
 // ---------------------- Data helpers ----------------------
 static void dedup_preserve_order(vector<string>& v) {
-  vector<string> out;
-  out.reserve(v.size());
-  for (auto &x : v) {
-    bool seen = false;
-    for (auto &y : out) {
-      if (x == y) { seen = true; break; }
+  // mark first occurrences while v is untouched, then compact in place
+  vector<char> keep(v.size(), 0);
+  {
+    unordered_set<string_view> seen;
+    seen.reserve(v.size());
+    for (size_t i = 0; i < v.size(); i++) keep[i] = seen.insert(v[i]).second;
+  }
+  size_t w = 0;
+  for (size_t i = 0; i < v.size(); i++) {
+    if (!keep[i]) continue;
+    if (w != i) v[w] = move(v[i]);
+    w++;
+  }
+  v.resize(w);
+}
+
+// ---------------------- Background jobs ----------------------
+// Shared between a worker thread and the UI loop that draws its progress.
+// `done`/`total` are in job units (bytes for loads, rows for exports);
+// `bytes` is what the progress line reports as throughput.
+struct JobProgress {
+  atomic<uint64_t> done{0};
+  atomic<uint64_t> total{0};
+  atomic<uint64_t> bytes{0};
+  atomic<bool> cancel{false};
+};
+
+// One name per line (trimmed, blank lines skipped), read in large chunks.
+// Returns false if the file can't be opened or the job was cancelled.
+static bool read_names_file(const string& filename, vector<string>& names, JobProgress* prog = nullptr) {
+  ifstream fin(filename, ios::binary);
+  if (!fin) return false;
+  if (prog) {
+    fin.seekg(0, ios::end);
+    prog->total = (uint64_t)max<streamoff>(0, (streamoff)fin.tellg());
+    fin.seekg(0, ios::beg);
+  }
+
+  string buf(1 << 20, '\0');
+  string carry;
+  auto take = [&](const char* b, const char* e) {
+    string line = trim(string(b, e));
+    if (!line.empty()) names.push_back(move(line));
+  };
+  while (true) {
+    if (prog && prog->cancel) return false;
+    fin.read(&buf[0], (streamsize)buf.size());
+    size_t got = (size_t)fin.gcount();
+    if (got == 0) break;
+    const char* p = buf.data();
+    const char* end = p + got;
+    while (p < end) {
+      const char* nl = (const char*)memchr(p, '\n', (size_t)(end - p));
+      if (!nl) { carry.append(p, end); break; }
+      if (carry.empty()) take(p, nl);
+      else { carry.append(p, nl); take(carry.data(), carry.data() + carry.size()); carry.clear(); }
+      p = nl + 1;
+    }
+    if (prog) { prog->done += got; prog->bytes += got; }
+  }
+  if (!carry.empty()) take(carry.data(), carry.data() + carry.size());
+  return true;
+}
+
+// ---------------------- Int store (heap or memory-mapped) ----------------------
+// vector<int>-like array used for the mode B pool/history. It lives on the heap
+// unless attach()ed to a file with a layout that is stable across runs:
+//   MappedIntHeader | int32 values[capacity]
+// Updates then land in the page cache in place, and commit() msyncs every
+// `syncEvery` operations instead of on every write.
+struct MappedIntHeader {
+  char magic[4];
+  uint32_t version;
+  uint64_t count;
+  uint64_t capacity;
+  int64_t tag[2];   // owner metadata (mode B keeps N / no-repeat here)
+};
+
+static const char MAPPED_INT_MAGIC[4] = {'D', 'R', 'W', 'M'};
+static const uint32_t MAPPED_INT_VERSION = 1;
+
+class IntStore {
+public:
+  IntStore() = default;
+  IntStore(const IntStore&) = delete;
+  IntStore& operator=(const IntStore&) = delete;
+  IntStore(IntStore&& o) noexcept { swap(o); }
+  IntStore& operator=(IntStore&& o) noexcept { if (this != &o) { detach(); swap(o); } return *this; }
+  ~IntStore() { detach(); }
+
+  bool mapped() const { return hdr_ != nullptr; }
+  size_t size() const { return mapped() ? (size_t)hdr_->count : heap_.size(); }
+  bool empty() const { return size() == 0; }
+  int* data() { return mapped() ? vals_ : heap_.data(); }
+  const int* data() const { return mapped() ? vals_ : heap_.data(); }
+  int* begin() { return data(); }
+  int* end() { return data() + size(); }
+  const int* begin() const { return data(); }
+  const int* end() const { return data() + size(); }
+  int& operator[](size_t i) { return data()[i]; }
+  const int& operator[](size_t i) const { return data()[i]; }
+  int& back() { return data()[size() - 1]; }
+
+  void reserve(size_t n) {
+    if (!mapped()) { heap_.reserve(n); return; }
+    if (n > hdr_->capacity) grow(n);
+  }
+  void push_back(int v) {
+    if (!mapped()) { heap_.push_back(v); return; }
+    if (hdr_->count == hdr_->capacity) grow(hdr_->capacity * 2);
+    vals_[hdr_->count++] = v;
+  }
+  void pop_back() {
+    if (!mapped()) heap_.pop_back();
+    else hdr_->count--;
+  }
+  void resize(size_t n) {
+    if (!mapped()) { heap_.resize(n); return; }
+    reserve(n);
+    for (size_t i = (size_t)hdr_->count; i < n; i++) vals_[i] = 0;
+    hdr_->count = n;
+  }
+  void erase(int* it) {
+    int* e = end();
+    memmove(it, it + 1, (size_t)(e - it - 1) * sizeof(int));
+    pop_back();
+  }
+  void clear() {
+    if (!mapped()) heap_.clear();
+    else hdr_->count = 0;
+  }
+
+  int64_t tag(int i) const { return mapped() ? hdr_->tag[i] : 0; }
+  void set_tag(int i, int64_t v) { if (mapped()) hdr_->tag[i] = v; }
+
+  // Back this store with `path`, created if missing. Existing contents of the
+  // file win over whatever is in memory. Returns false if the file is unusable.
+  bool attach(const string& path, uint32_t syncEvery) {
+#ifdef _WIN32
+    (void)path; (void)syncEvery;
+    return false;
+#else
+    detach();
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return false;
+    struct stat stt;
+    if (fstat(fd, &stt) != 0) { ::close(fd); return false; }
+    bool fresh = stt.st_size == 0;
+    size_t len = fresh ? sizeof(MappedIntHeader) + 1024 * sizeof(int) : (size_t)stt.st_size;
+    if (fresh && ftruncate(fd, (off_t)len) != 0) { ::close(fd); return false; }
+    if (len < sizeof(MappedIntHeader)) { ::close(fd); return false; }
+    void* m = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED) { ::close(fd); return false; }
+    MappedIntHeader* h = (MappedIntHeader*)m;
+    if (fresh) {
+      memcpy(h->magic, MAPPED_INT_MAGIC, 4);
+      h->version = MAPPED_INT_VERSION;
+      h->count = 0;
+      h->capacity = (len - sizeof(MappedIntHeader)) / sizeof(int);
+      h->tag[0] = h->tag[1] = 0;
+    } else if (memcmp(h->magic, MAPPED_INT_MAGIC, 4) != 0 || h->version != MAPPED_INT_VERSION ||
+               h->capacity > (len - sizeof(MappedIntHeader)) / sizeof(int) || h->count > h->capacity) {
+      munmap(m, len);
+      ::close(fd);
+      return false;
+    }
+    heap_.clear();
+    heap_.shrink_to_fit();
+    fd_ = fd;
+    hdr_ = h;
+    vals_ = (int*)(h + 1);
+    mapLen_ = len;
+    syncEvery_ = syncEvery;
+    pending_ = 0;
+    return true;
+#endif
+  }
+
+  // call once per logical operation; flushes every syncEvery operations
+  void commit() {
+    if (!mapped()) return;
+    if (syncEvery_ && ++pending_ >= syncEvery_) sync();
+  }
+
+  void sync() {
+#ifndef _WIN32
+    if (!mapped()) return;
+    msync(hdr_, mapLen_, MS_SYNC);
+    pending_ = 0;
+#endif
+  }
+
+  void detach() {
+#ifndef _WIN32
+    if (!mapped()) return;
+    sync();
+    munmap(hdr_, mapLen_);
+    ::close(fd_);
+    fd_ = -1;
+    hdr_ = nullptr;
+    vals_ = nullptr;
+    mapLen_ = 0;
+#endif
+  }
+
+private:
+  void grow(uint64_t cap) {
+#ifndef _WIN32
+    if (cap < 1024) cap = 1024;
+    size_t len = sizeof(MappedIntHeader) + (size_t)cap * sizeof(int);
+    msync(hdr_, mapLen_, MS_ASYNC);
+    munmap(hdr_, mapLen_);
+    void* m = MAP_FAILED;
+    if (ftruncate(fd_, (off_t)len) == 0) m = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+    if (m == MAP_FAILED) {
+      // keep the old (still valid) size mapped; callers only grow on demand
+      m = mmap(nullptr, mapLen_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+      if (m == MAP_FAILED) { cerr << "mmap 失敗\n"; abort(); }
+      len = mapLen_;
+    }
+    hdr_ = (MappedIntHeader*)m;
+    vals_ = (int*)(hdr_ + 1);
+    mapLen_ = len;
+    hdr_->capacity = (len - sizeof(MappedIntHeader)) / sizeof(int);
+#else
+    (void)cap;
+#endif
+  }
+
+public:
+  void swap(IntStore& o) {
+    heap_.swap(o.heap_);
+    std::swap(fd_, o.fd_);
+    std::swap(hdr_, o.hdr_);
+    std::swap(vals_, o.vals_);
+    std::swap(mapLen_, o.mapLen_);
+    std::swap(syncEvery_, o.syncEvery_);
+    std::swap(pending_, o.pending_);
+  }
+
+private:
+
+  vector<int> heap_;
+  int fd_ = -1;
+  MappedIntHeader* hdr_ = nullptr;
+  int* vals_ = nullptr;
+  size_t mapLen_ = 0;
+  uint32_t syncEvery_ = 0;
+  uint32_t pending_ = 0;
+};
+
+// ---------------------- Session state ----------------------
+// Undo/redo is an operation log: each entry holds just enough to step the
+// state back or forward in O(1) (draws) or by swapping whole containers
+// (reset / set N), never by copying pool or roster.
+
+// What the last export wrote, so the next one can append only new rows.
+// Undo can take back rows that are already in the file; then only a full
+// rewrite is correct.
+struct ExportMark {
+  size_t rows = 0;     // history rows already written by the last export
+  bool stale = false;  // the file holds rows that undo/redo replaced
+  uint32_t seq = 0;    // exports so far
+};
+
+// undo of a draw: the history may now end below what the file holds
+static void export_mark_truncate(ExportMark& m, size_t historySize) {
+  if (m.rows > historySize) {
+    m.rows = historySize;
+    m.stale = true;
+  }
+}
+
+// whole-state swap (reset / set N and their undo): the other side's mark comes
+// back only if nothing was exported in between; otherwise the file was written
+// from the state being swapped out
+static void export_mark_swap(ExportMark& m, size_t& opRows, uint32_t& opSeq) {
+  size_t cur = m.rows;
+  if (m.seq == opSeq) m.rows = opRows;
+  else { m.rows = 0; m.stale = true; }
+  opRows = cur;
+  opSeq = m.seq;
+}
+
+struct ListOp {
+  enum Kind : uint8_t { ADD, DRAW, RESET } kind = DRAW;
+  size_t idx = 0;                    // DRAW: pool slot the winner came from
+  uint64_t ts = 0;                   // DRAW: draw time
+  size_t allSize = 0, poolSize = 0;  // ADD: sizes before the add
+  vector<string> allAdded, poolAdded;  // ADD: what actually got appended (after dedup)
+  vector<string> pool, history;      // RESET: the state on the other side
+  vector<uint64_t> drawnAt;
+  unordered_map<string, size_t> drawnPos;
+  size_t exportRows = 0;             // RESET: export mark on the other side
+  uint32_t exportSeq = 0;
+};
+
+struct ListState {
+  vector<string> all;
+  vector<string> pool;
+  vector<string> history;
+  vector<uint64_t> drawnAt;  // unix ms per history entry
+  unordered_map<string, size_t> drawnPos;  // winner -> history index
+  ExportMark exported;
+  vector<ListOp> undo, redo;
+};
+
+struct RangeOp {
+  enum Kind : uint8_t { DRAW, STATE, REPEAT_ON } kind = DRAW;
+  size_t idx = 0;         // DRAW: pool slot (no-repeat only)
+  int value = 0;          // DRAW
+  uint64_t ts = 0;        // DRAW
+  bool fromPool = false;  // DRAW: taken from the pool (no-repeat at the time)
+  int N = 0;              // STATE: the state on the other side
+  bool noRepeat = true;
+  IntStore pool, history;
+  vector<uint64_t> drawnAt;
+  unordered_map<int, size_t> drawnLast;
+  vector<size_t> drawnPrev;
+  size_t exportRows = 0;  // STATE: export mark on the other side
+  uint32_t exportSeq = 0;
+};
+
+struct RangeState {
+  int N = 0;
+  bool noRepeat = true;
+  IntStore pool;     // for no-repeat
+  IntStore history;  // drawn numbers
+  vector<uint64_t> drawnAt;  // unix ms per history entry (heap only, even when mapped)
+  // number -> its latest history index; drawnPrev[i] chains back to the
+  // previous draw of the same number (NO_POS ends it), for with-replacement
+  unordered_map<int, size_t> drawnLast;
+  vector<size_t> drawnPrev;
+  size_t cooldown = 0;  // no-repeat off: keep out the last W draws (0 = off; not saved)
+  uint64_t version = 0;  // bumped by every change (range_commit), for derived caches
+  ExportMark exported;
+  vector<RangeOp> undo, redo;
+};
+
+// Everything one draw session owns: both modes plus the RNG and its seed.
+class FileMap;
+
+// Mode A as a resumed snapshot holds it, still inside the mapped file:
+// roster / pool / history sections are only copied out into ListState by
+// list_ready(), the first time something needs mode A.
+struct ListImage {
+  shared_ptr<FileMap> map;
+  uint64_t roster_off = 0, roster_count = 0;
+  uint64_t pool_off = 0, pool_count = 0;
+  uint64_t hist_off = 0, hist_count = 0, hist_ts_off = 0;
+  uint64_t ops_off = 0, ops_len = 0;
+};
+
+struct Session {
+  ListState list;
+  ListImage listImage;   // set while mode A hasn't been read out of the snapshot
+  RangeState range;
+  mt19937 rng;
+  uint32_t seed = 0;
+  uint64_t snapshotId = 0;  // the snapshot this session continues (0 = a new one)
+};
+
+static const size_t NO_POS = (size_t)-1;
+
+// History indexes: kept in step with every push/pop of history, rebuilt only
+// when a whole history is loaded (snapshot, mapped store).
+static void list_reindex(ListState& st) {
+  st.drawnPos.clear();
+  st.drawnPos.reserve(st.history.size());
+  for (size_t i = 0; i < st.history.size(); i++) st.drawnPos[st.history[i]] = i;
+}
+
+static void range_index_push(RangeState& st, int value) {
+  auto ins = st.drawnLast.emplace(value, st.history.size() - 1);
+  st.drawnPrev.push_back(ins.second ? NO_POS : ins.first->second);
+  if (!ins.second) ins.first->second = st.history.size() - 1;
+}
+
+static void range_index_pop(RangeState& st, int value) {
+  size_t prev = st.drawnPrev.back();
+  st.drawnPrev.pop_back();
+  if (prev == NO_POS) st.drawnLast.erase(value);
+  else st.drawnLast[value] = prev;
+}
+
+static void range_reindex(RangeState& st) {
+  st.drawnLast.clear();
+  st.drawnPrev.clear();
+  st.drawnPrev.reserve(st.history.size());
+  IntStore& h = st.history;
+  for (size_t i = 0; i < h.size(); i++) {
+    auto ins = st.drawnLast.emplace(h[i], i);
+    st.drawnPrev.push_back(ins.second ? NO_POS : ins.first->second);
+    if (!ins.second) ins.first->second = i;
+  }
+}
+
+// all history indexes of value, oldest first
+static vector<size_t> range_positions(const RangeState& st, int value) {
+  vector<size_t> out;
+  auto it = st.drawnLast.find(value);
+  if (it == st.drawnLast.end()) return out;
+  for (size_t i = it->second; i != NO_POS; i = st.drawnPrev[i]) out.push_back(i);
+  reverse(out.begin(), out.end());
+  return out;
+}
+
+// All state changes go through these, so the journal replay and the menus
+// always agree on what an operation does (including what undo/redo can see).
+static void list_record(ListState& st, ListOp&& op) {
+  st.undo.push_back(move(op));
+  st.redo.clear();
+}
+
+static void list_do_add(ListState& st, const vector<string>& names) {
+  for (auto &n : names) {
+    st.all.push_back(n);
+    st.pool.push_back(n);
+  }
+  // both lists are already duplicate-free, so dedup only drops new names:
+  // the old contents stay a prefix, which is what undo truncates back to
+  dedup_preserve_order(st.all);
+  dedup_preserve_order(st.pool);
+}
+
+static int list_add_names(ListState& st, const vector<string>& names) {
+  ListOp op;
+  op.kind = ListOp::ADD;
+  op.allSize = st.all.size();
+  op.poolSize = st.pool.size();
+  list_do_add(st, names);
+  op.allAdded.assign(st.all.begin() + op.allSize, st.all.end());
+  op.poolAdded.assign(st.pool.begin() + op.poolSize, st.pool.end());
+  list_record(st, move(op));
+  return (int)names.size();
+}
+
+// The pool is unordered: the drawn slot is refilled from the back in O(1).
+static string list_do_draw(ListState& st, size_t idx, uint64_t ts) {
+  string winner = move(st.pool[idx]);
+  if (idx + 1 != st.pool.size()) st.pool[idx] = move(st.pool.back());
+  st.pool.pop_back();
+  st.drawnPos[winner] = st.history.size();
+  st.history.push_back(winner);
+  st.drawnAt.push_back(ts);
+  return winner;
+}
+
+static string list_apply_draw(ListState& st, size_t idx, uint64_t ts) {
+  ListOp op;
+  op.kind = ListOp::DRAW;
+  op.idx = idx;
+  op.ts = ts;
+  string winner = list_do_draw(st, idx, ts);
+  list_record(st, move(op));
+  return winner;
+}
+
+static void list_swap_state(ListState& st, ListOp& op) {
+  st.pool.swap(op.pool);
+  st.history.swap(op.history);
+  st.drawnAt.swap(op.drawnAt);
+  st.drawnPos.swap(op.drawnPos);
+  export_mark_swap(st.exported, op.exportRows, op.exportSeq);
+}
+
+static void list_reset(ListState& st) {
+  ListOp op;
+  op.kind = ListOp::RESET;
+  op.pool = st.all;
+  op.exportSeq = st.exported.seq;  // the fresh history starts with nothing exported
+  list_swap_state(st, op);
+  list_record(st, move(op));
+}
+
+static bool list_undo(ListState& st) {
+  if (st.undo.empty()) return false;
+  ListOp op = move(st.undo.back());
+  st.undo.pop_back();
+  if (op.kind == ListOp::ADD) {
+    st.all.resize(op.allSize);
+    st.pool.resize(op.poolSize);
+  } else if (op.kind == ListOp::DRAW) {
+    string w = move(st.history.back());
+    st.drawnPos.erase(w);
+    st.history.pop_back();
+    st.drawnAt.pop_back();
+    export_mark_truncate(st.exported, st.history.size());
+    if (op.idx == st.pool.size()) st.pool.push_back(move(w));
+    else {
+      st.pool.push_back(move(st.pool[op.idx]));
+      st.pool[op.idx] = move(w);
+    }
+  } else {
+    list_swap_state(st, op);
+  }
+  st.redo.push_back(move(op));
+  return true;
+}
+
+static bool list_redo(ListState& st) {
+  if (st.redo.empty()) return false;
+  ListOp op = move(st.redo.back());
+  st.redo.pop_back();
+  if (op.kind == ListOp::ADD) {
+    st.all.insert(st.all.end(), op.allAdded.begin(), op.allAdded.end());
+    st.pool.insert(st.pool.end(), op.poolAdded.begin(), op.poolAdded.end());
+  }
+  else if (op.kind == ListOp::DRAW) list_do_draw(st, op.idx, op.ts);
+  else list_swap_state(st, op);
+  st.undo.push_back(move(op));
+  return true;
+}
+
+// mapped stores persist N / no-repeat alongside the pool
+static void range_commit(RangeState& st) {
+  st.version++;
+  st.pool.set_tag(0, st.N);
+  st.pool.set_tag(1, st.noRepeat ? 1 : 0);
+  st.pool.commit();
+  st.history.commit();
+}
+
+static void range_record(RangeState& st, RangeOp&& op) {
+  st.undo.push_back(move(op));
+  st.redo.clear();
+}
+
+static void range_swap_state(RangeState& st, RangeOp& op) {
+  swap(st.N, op.N);
+  swap(st.noRepeat, op.noRepeat);
+  st.pool.swap(op.pool);
+  st.history.swap(op.history);
+  st.drawnAt.swap(op.drawnAt);
+  st.drawnLast.swap(op.drawnLast);
+  st.drawnPrev.swap(op.drawnPrev);
+  export_mark_swap(st.exported, op.exportRows, op.exportSeq);
+  range_commit(st);
+}
+
+// Moves the current state into the undo log before an op replaces it. A mapped
+// store can't be moved aside, so there the log is cleared instead (draws after
+// this point stay undoable).
+static void range_begin_replace(RangeState& st) {
+  if (st.pool.mapped()) {
+    st.undo.clear();
+    st.redo.clear();
+    return;
+  }
+  RangeOp op;
+  op.kind = RangeOp::STATE;
+  op.N = st.N;
+  op.noRepeat = st.noRepeat;
+  op.exportSeq = st.exported.seq;
+  range_swap_state(st, op);
+  range_record(st, move(op));
+}
+
+static void range_rebuild(RangeState& st) {
+  st.pool.clear();
+  st.history.clear();
+  st.drawnAt.clear();
+  st.drawnLast.clear();
+  st.drawnPrev.clear();
+  st.exported.rows = 0;
+  if (st.N > 0) {
+    st.pool.reserve(st.N);
+    for (int i = 1; i <= st.N; i++) st.pool.push_back(i);
+  }
+  range_commit(st);
+}
+
+static void range_reset(RangeState& st) {
+  range_begin_replace(st);
+  range_rebuild(st);
+}
+
+static void range_set_n(RangeState& st, int N) {
+  range_begin_replace(st);
+  st.N = N > 0 ? N : 0;
+  range_rebuild(st);
+}
+
+static void range_set_norepeat(RangeState& st, bool on) {
+  if (on) {
+    range_begin_replace(st);
+    st.noRepeat = true;
+    range_rebuild(st);
+    return;
+  }
+  // turning no-repeat off leaves pool/history alone
+  st.noRepeat = false;
+  range_commit(st);
+  RangeOp op;
+  op.kind = RangeOp::REPEAT_ON;
+  range_record(st, move(op));
+}
+
+// idx is only meaningful in no-repeat mode (position in pool). The pool is
+// unordered, so the drawn slot is refilled from the back in O(1).
+static void range_do_draw(RangeState& st, size_t idx, int value, uint64_t ts) {
+  if (st.noRepeat) {
+    st.pool[idx] = st.pool.back();
+    st.pool.pop_back();
+  }
+  st.history.push_back(value);
+  st.drawnAt.push_back(ts);
+  range_index_push(st, value);
+  range_commit(st);
+}
+
+static void range_apply_draw(RangeState& st, size_t idx, int value, uint64_t ts) {
+  RangeOp op;
+  op.kind = RangeOp::DRAW;
+  op.idx = idx;
+  op.value = value;
+  op.ts = ts;
+  op.fromPool = st.noRepeat;
+  range_do_draw(st, idx, value, ts);
+  range_record(st, move(op));
+}
+
+static bool range_undo(RangeState& st) {
+  if (st.undo.empty()) return false;
+  RangeOp op = move(st.undo.back());
+  st.undo.pop_back();
+  if (op.kind == RangeOp::DRAW) {
+    range_index_pop(st, op.value);
+    st.history.pop_back();
+    st.drawnAt.pop_back();
+    export_mark_truncate(st.exported, st.history.size());
+    if (op.fromPool) {
+      if (op.idx == st.pool.size()) st.pool.push_back(op.value);
+      else {
+        st.pool.push_back(st.pool[op.idx]);
+        st.pool[op.idx] = op.value;
+      }
+    }
+    range_commit(st);
+  } else if (op.kind == RangeOp::REPEAT_ON) {
+    st.noRepeat = true;
+    range_commit(st);
+  } else {
+    range_swap_state(st, op);
+  }
+  st.redo.push_back(move(op));
+  return true;
+}
+
+static bool range_redo(RangeState& st) {
+  if (st.redo.empty()) return false;
+  RangeOp op = move(st.redo.back());
+  st.redo.pop_back();
+  if (op.kind == RangeOp::DRAW) range_do_draw(st, op.idx, op.value, op.ts);
+  else if (op.kind == RangeOp::REPEAT_ON) { st.noRepeat = false; range_commit(st); }
+  else range_swap_state(st, op);
+  st.undo.push_back(move(op));
+  return true;
+}
+
+// Back mode B with PREFIX.pool / PREFIX.hist. A previous session found there
+// is picked up as-is (N and no-repeat come from the pool header); its draw
+// times aren't in the files, so those rows get 0 and new draws line up after.
+static bool range_attach(RangeState& st, const string& prefix, uint32_t syncEvery) {
+  bool existed = ifstream(prefix + ".pool").good();
+  if (!st.pool.attach(prefix + ".pool", syncEvery) || !st.history.attach(prefix + ".hist", syncEvery)) {
+    st.pool.detach();
+    st.history.detach();
+    return false;
+  }
+  if (existed) {
+    st.N = (int)st.pool.tag(0);
+    st.noRepeat = st.pool.tag(1) != 0;
+    st.drawnAt.assign(st.history.size(), 0);
+    range_reindex(st);
+  } else {
+    range_rebuild(st);
+  }
+  return true;
+}
+
+// ---------------------- Time travel ----------------------
+// The pool as it was right before draw #k (1-based, current history) is kept
+// as an overlay on today's pool instead of a copy: walking the undo log back
+// from the end, an undone draw puts its winner back (+1) and an undone load
+// takes the names it appended out again (-1). Only the ops after draw #k are
+// visited, so building the view costs O(delta); membership is pool + delta.
+// The log survives --resume (the snapshot keeps it back to the last reset);
+// draws older than it (a version 2 snapshot) still count as +1, but loads
+// made after them can't be seen, so the view is marked inexact.
+template <class T>
+struct PoolAt {
+  size_t count = 0;
+  bool exact = true;
+  unordered_map<T, int> delta;
+
+  // every member: the current pool minus later additions, plus later winners
+  template <class Pool, class Fn>
+  void for_each(const Pool& pool, Fn&& fn) const {
+    for (auto &x : pool) {
+      auto it = delta.find(x);
+      if (it == delta.end() || it->second >= 0) fn(x);
+    }
+    for (auto &kv : delta) if (kv.second > 0) fn(kv.first);
+  }
+};
+
+static PoolAt<string> list_pool_at(const ListState& st, size_t k) {
+  PoolAt<string> r;
+  size_t need = st.history.size() - (k - 1);  // draws to step back over
+  size_t seen = 0;
+  long change = 0;
+  for (size_t i = st.undo.size(); i > 0 && seen < need; i--) {
+    const ListOp& op = st.undo[i - 1];
+    if (op.kind == ListOp::DRAW) {
+      r.delta[st.history[st.history.size() - 1 - seen]]++;
+      change++;
+      seen++;
+    } else if (op.kind == ListOp::ADD) {
+      for (auto &n : op.poolAdded) r.delta[n]--;
+      change -= (long)op.poolAdded.size();
+    } else {
+      break;  // RESET: the current history starts here
+    }
+  }
+  for (; seen < need; seen++) {
+    r.delta[st.history[st.history.size() - 1 - seen]]++;
+    change++;
+    r.exact = false;
+  }
+  r.count = (size_t)((long)st.pool.size() + change);
+  return r;
+}
+
+// mode B: only draws taken from the no-repeat pool change it
+static PoolAt<int> range_pool_at(const RangeState& st, size_t k) {
+  PoolAt<int> r;
+  size_t need = st.history.size() - (k - 1);
+  size_t seen = 0;
+  long change = 0;
+  for (size_t i = st.undo.size(); i > 0 && seen < need; i--) {
+    const RangeOp& op = st.undo[i - 1];
+    if (op.kind == RangeOp::DRAW) {
+      if (op.fromPool) { r.delta[op.value]++; change++; }
+      seen++;
+    } else if (op.kind == RangeOp::STATE) {
+      break;
+    }
+  }
+  if (seen < need) {
+    r.exact = false;
+    if (st.noRepeat) {
+      for (; seen < need; seen++) { r.delta[st.history[st.history.size() - 1 - seen]]++; change++; }
+    }
+  }
+  r.count = (size_t)((long)st.pool.size() + change);
+  return r;
+}
+
+// ---------------------- Cooldown window ----------------------
+// With no-repeat off, mode B can still keep a number out of the next W draws.
+// The window is the last W entries of the history, held in a ring buffer so
+// it follows undo / replay for free (any state change it did not see itself
+// rebuilds it from RangeState::version). Small
+// windows (W <= N/2) count the cooling numbers in a hash map and reject;
+// larger ones keep 1..N permuted with the cooling numbers swapped to the
+// tail, so a draw is one uniform index into the head. Both are O(1) a draw.
+class CooldownSampler {
+public:
+  // a number in 1..N that is not among the last w draws (w is capped at N-1)
+  int draw(const RangeState& st, size_t w, mt19937& rng) {
+    w = min(w, (size_t)st.N - 1);
+    if (w != w_ || st.N != n_ || st.version != version_) rebuild(st, w);
+    if (reject_) {
+      uniform_int_distribution<int> dist(1, n_);
+      int v;
+      do v = dist(rng); while (hot_.count(v));
+      return v;
+    }
+    return perm_[uniform_int_distribution<size_t>(0, open_ - 1)(rng)];
+  }
+
+  // call right after the drawn number went into the history
+  void push(const RangeState& st, int v) {
+    if (st.version != version_ + 1) return;  // missed a change: the next draw rebuilds
+    add(v);
+    version_ = st.version;
+  }
+
+private:
+  void add(int v) {
+    if (w_ == 0) return;
+    if (used_ == w_) {
+      leave(ring_[head_]);
+      ring_[head_] = v;
+      head_ = (head_ + 1) % w_;
+    } else {
+      ring_[(head_ + used_++) % w_] = v;
+    }
+    enter(v);
+  }
+
+  void rebuild(const RangeState& st, size_t w) {
+    w_ = w;
+    n_ = st.N;
+    reject_ = w * 2 <= (size_t)n_;
+    ring_.assign(w, 0);
+    head_ = used_ = 0;
+    hot_.clear();
+    perm_.clear();
+    pos_.clear();
+    cnt_.clear();
+    if (!reject_) {
+      perm_.resize(n_);
+      pos_.resize(n_ + 1);
+      cnt_.assign(n_ + 1, 0);
+      for (int v = 1; v <= n_; v++) { perm_[v - 1] = v; pos_[v] = v - 1; }
+      open_ = n_;
+    }
+    size_t h = st.history.size();
+    for (size_t i = h - min(h, w); i < h; i++) add(st.history[i]);
+    version_ = st.version;
+  }
+
+  void enter(int v) {
+    if (v < 1 || v > n_) return;
+    if (reject_) { hot_[v]++; return; }
+    if (cnt_[v]++ == 0) move_to(v, --open_);
+  }
+  void leave(int v) {
+    if (v < 1 || v > n_) return;
+    if (reject_) {
+      auto it = hot_.find(v);
+      if (it != hot_.end() && --it->second == 0) hot_.erase(it);
+      return;
+    }
+    if (--cnt_[v] == 0) move_to(v, open_++);
+  }
+  void move_to(int v, size_t slot) {
+    int other = perm_[slot];
+    swap(perm_[pos_[v]], perm_[slot]);
+    pos_[other] = pos_[v];
+    pos_[v] = (uint32_t)slot;
+  }
+
+  size_t w_ = 0, head_ = 0, used_ = 0, open_ = 0;
+  uint64_t version_ = UINT64_MAX;
+  int n_ = 0;
+  bool reject_ = true;
+  vector<int> ring_;
+  unordered_map<int, uint32_t> hot_;  // reject: number -> times in the window
+  vector<int> perm_;                  // swap: [0, open_) may be drawn
+  vector<uint32_t> pos_, cnt_;        // swap: number -> slot in perm_ / times in the window
+};
+
+// ---------------------- File I/O helpers ----------------------
+static void put_u32(string& b, uint32_t v) { b.append((const char*)&v, 4); }
+static void put_u64(string& b, uint64_t v) { b.append((const char*)&v, 8); }
+static uint32_t get_u32(const char* p) { uint32_t v; memcpy(&v, p, 4); return v; }
+static uint64_t get_u64(const char* p) { uint64_t v; memcpy(&v, p, 8); return v; }
+
+static uint64_t now_unix_ms() {
+  return (uint64_t)chrono::duration_cast<chrono::milliseconds>(
+    chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// thin wrappers so the journal/snapshot code reads the same on every platform
+#ifdef _WIN32
+static int sys_open_append(const string& path) {
+  return _open(path.c_str(), _O_WRONLY | _O_APPEND | _O_CREAT | _O_BINARY, 0644);
+}
+static int sys_open_write(const string& path) {
+  return _open(path.c_str(), _O_WRONLY | _O_TRUNC | _O_CREAT | _O_BINARY, 0644);
+}
+static long sys_write(int fd, const char* p, size_t n) { return _write(fd, p, (unsigned)n); }
+static bool sys_datasync(int fd) { return _commit(fd) == 0; }
+static void sys_close(int fd) { _close(fd); }
+static bool sys_truncate(const string& path, uint64_t len) {
+  int fd = _open(path.c_str(), _O_WRONLY | _O_BINARY);
+  if (fd < 0) return false;
+  bool ok = _chsize_s(fd, (long long)len) == 0;
+  _close(fd);
+  return ok;
+}
+static bool sys_replace(const string& from, const string& to) {
+  return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+}
+#else
+static int sys_open_append(const string& path) {
+  return ::open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+}
+static int sys_open_write(const string& path) {
+  return ::open(path.c_str(), O_WRONLY | O_TRUNC | O_CREAT, 0644);
+}
+static long sys_write(int fd, const char* p, size_t n) { return (long)::write(fd, p, n); }
+static bool sys_datasync(int fd) {
+#ifdef __APPLE__
+  return ::fsync(fd) == 0;
+#else
+  return ::fdatasync(fd) == 0;
+#endif
+}
+static void sys_close(int fd) { ::close(fd); }
+static bool sys_truncate(const string& path, uint64_t len) {
+  return ::truncate(path.c_str(), (off_t)len) == 0;
+}
+static bool sys_replace(const string& from, const string& to) {
+  return ::rename(from.c_str(), to.c_str()) == 0;
+}
+#endif
+
+static bool sys_write_all(int fd, const char* p, size_t n) {
+  while (n > 0) {
+    long w = sys_write(fd, p, n);
+    if (w <= 0) return false;
+    p += w;
+    n -= (size_t)w;
+  }
+  return true;
+}
+
+// write to PATH.tmp, sync, then rename over PATH so readers never see half a file
+static bool write_file_atomic(const string& path, const string& data) {
+  string tmp = path + ".tmp";
+  int fd = sys_open_write(tmp);
+  if (fd < 0) return false;
+  bool ok = sys_write_all(fd, data.data(), data.size()) && sys_datasync(fd);
+  sys_close(fd);
+  if (!ok || !sys_replace(tmp, path)) { remove(tmp.c_str()); return false; }
+  return true;
+}
+
+// Read-only view of a whole file (mmap / MapViewOfFile)
+class FileMap {
+public:
+  FileMap() = default;
+  FileMap(const FileMap&) = delete;
+  FileMap& operator=(const FileMap&) = delete;
+  ~FileMap() { close(); }
+
+  bool open(const string& path) {
+    close();
+#ifdef _WIN32
+    file_ = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file_ == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER sz;
+    if (!GetFileSizeEx(file_, &sz)) { close(); return false; }
+    if (sz.QuadPart == 0) return true;
+    size_ = (size_t)sz.QuadPart;
+    mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping_) { close(); return false; }
+    data_ = (const char*)MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+    if (!data_) { close(); return false; }
+#else
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat stt;
+    if (fstat(fd, &stt) != 0) { ::close(fd); return false; }
+    size_ = (size_t)stt.st_size;
+    if (size_ > 0) {
+      void* m = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (m == MAP_FAILED) { ::close(fd); size_ = 0; return false; }
+      data_ = (const char*)m;
+    }
+    ::close(fd);
+#endif
+    return true;
+  }
+
+  void close() {
+#ifdef _WIN32
+    if (data_) UnmapViewOfFile(data_);
+    if (mapping_) CloseHandle(mapping_);
+    if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+    mapping_ = nullptr;
+    file_ = INVALID_HANDLE_VALUE;
+#else
+    if (data_) munmap((void*)data_, size_);
+#endif
+    data_ = nullptr;
+    size_ = 0;
+  }
+
+  const char* data() const { return data_; }
+  size_t size() const { return size_; }
+
+private:
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+#ifdef _WIN32
+  HANDLE file_ = INVALID_HANDLE_VALUE;
+  HANDLE mapping_ = nullptr;
+#endif
+};
+
+// Append-only output with one large buffer: rows are formatted in place
+// (integers via to_chars) and reach the file in few big write() calls.
+class BufferedWriter {
+public:
+  explicit BufferedWriter(size_t cap = 1 << 20) : cap_(cap) { buf_.reserve(cap_); }
+  BufferedWriter(const BufferedWriter&) = delete;
+  BufferedWriter& operator=(const BufferedWriter&) = delete;
+  ~BufferedWriter() { close(); }
+
+  bool open(const string& path, bool append) {
+    close();
+    fd_ = append ? sys_open_append(path) : sys_open_write(path);
+    owned_ = true;
+    ok_ = fd_ >= 0;
+    return ok_;
+  }
+
+  // the process's standard output (left open on close)
+  bool open_stdout() {
+    close();
+    fflush(stdout);
+    fd_ = fileno(stdout);
+    owned_ = false;
+    ok_ = fd_ >= 0;
+    return ok_;
+  }
+
+  bool close() {
+    if (fd_ < 0) return ok_;
+    flush();
+    if (owned_) sys_close(fd_);
+    fd_ = -1;
+    return ok_;
+  }
+
+  void put(string_view s) {
+    if (buf_.size() + s.size() > cap_) flush();
+    if (s.size() > cap_) { write_out(s.data(), s.size()); return; }
+    buf_.append(s.data(), s.size());
+  }
+  void put(char c) {
+    if (buf_.size() + 1 > cap_) flush();
+    buf_.push_back(c);
+  }
+  void put_uint(uint64_t v) {
+    char tmp[20];
+    auto res = to_chars(tmp, tmp + sizeof(tmp), v);
+    put(string_view(tmp, (size_t)(res.ptr - tmp)));
+  }
+
+  void flush() {
+    if (!buf_.empty()) write_out(buf_.data(), buf_.size());
+    buf_.clear();
+  }
+
+  uint64_t bytes() const { return written_ + buf_.size(); }
+  bool ok() const { return ok_; }
+
+private:
+  void write_out(const char* p, size_t n) {
+    if (ok_ && !sys_write_all(fd_, p, n)) ok_ = false;
+    written_ += n;
+  }
+
+  size_t cap_;
+  string buf_;
+  int fd_ = -1;
+  bool ok_ = false;
+  bool owned_ = true;
+  uint64_t written_ = 0;
+};
+
+// ---------------------- Export ----------------------
+// One Exporter per output format, all formatting straight into the same
+// BufferedWriter. Row indices are 1-based positions in history, so appending
+// later rows to an earlier export continues the sequence.
+//   CSV:   index,name
+//   JSONL: {"draw":1,"mode":"list","name":"...","ts":<unix ms>,"seed":<seed>}
+//   BIN:   "DRWX" u32 version u32 seed u8 mode(0 list, 1 range), then records
+//          u32 len | u64 index | u64 ts | payload (name bytes / i32 number)
+enum ExportFormat { EXPORT_CSV = 1, EXPORT_JSONL = 2, EXPORT_BIN = 3 };
+
+struct ExportContext {
+  bool range;      // mode B rows carry numbers instead of names
+  uint32_t seed;
+};
+
+class Exporter {
+public:
+  virtual ~Exporter() = default;
+  // only for a new/empty file, never in front of appended rows
+  virtual void begin(BufferedWriter&, const ExportContext&) {}
+  virtual void row(BufferedWriter& w, const ExportContext& c, uint64_t index, uint64_t ts, string_view name) = 0;
+  virtual void row(BufferedWriter& w, const ExportContext& c, uint64_t index, uint64_t ts, int number) = 0;
+};
+
+static void put_int(BufferedWriter& w, int v) {
+  if (v < 0) { w.put('-'); w.put_uint((uint64_t)(-(int64_t)v)); }
+  else w.put_uint((uint64_t)v);
+}
+
+class CsvExporter : public Exporter {
+public:
+  void row(BufferedWriter& w, const ExportContext&, uint64_t index, uint64_t, string_view name) override {
+    w.put_uint(index);
+    w.put(',');
+    w.put(name);
+    w.put('\n');
+  }
+  void row(BufferedWriter& w, const ExportContext&, uint64_t index, uint64_t, int number) override {
+    w.put_uint(index);
+    w.put(',');
+    put_int(w, number);
+    w.put('\n');
+  }
+};
+
+// names are passed through as UTF-8; only quotes, backslashes and controls need escapes
+static void put_json_escaped(BufferedWriter& w, string_view s) {
+  size_t run = 0;
+  for (size_t i = 0; i < s.size(); i++) {
+    unsigned char ch = (unsigned char)s[i];
+    if (ch != '"' && ch != '\\' && ch >= 0x20) continue;
+    w.put(s.substr(run, i - run));
+    if (ch == '"') w.put("\\\"");
+    else if (ch == '\\') w.put("\\\\");
+    else {
+      static const char hex[] = "0123456789abcdef";
+      char esc[6] = {'\\', 'u', '0', '0', hex[ch >> 4], hex[ch & 15]};
+      w.put(string_view(esc, 6));
+    }
+    run = i + 1;
+  }
+  w.put(s.substr(run));
+}
+
+class JsonlExporter : public Exporter {
+public:
+  void row(BufferedWriter& w, const ExportContext& c, uint64_t index, uint64_t ts, string_view name) override {
+    head(w, index, "list");
+    w.put(",\"name\":\"");
+    put_json_escaped(w, name);
+    w.put('"');
+    tail(w, c, ts);
+  }
+  void row(BufferedWriter& w, const ExportContext& c, uint64_t index, uint64_t ts, int number) override {
+    head(w, index, "range");
+    w.put(",\"number\":");
+    put_int(w, number);
+    tail(w, c, ts);
+  }
+
+private:
+  static void head(BufferedWriter& w, uint64_t index, const char* mode) {
+    w.put("{\"draw\":");
+    w.put_uint(index);
+    w.put(",\"mode\":\"");
+    w.put(mode);
+    w.put('"');
+  }
+  static void tail(BufferedWriter& w, const ExportContext& c, uint64_t ts) {
+    w.put(",\"ts\":");
+    w.put_uint(ts);
+    w.put(",\"seed\":");
+    w.put_uint(c.seed);
+    w.put("}\n");
+  }
+};
+
+class BinaryExporter : public Exporter {
+public:
+  void begin(BufferedWriter& w, const ExportContext& c) override {
+    string h("DRWX", 4);
+    put_u32(h, 1);
+    put_u32(h, c.seed);
+    h.push_back(c.range ? '\1' : '\0');
+    w.put(h);
+  }
+  void row(BufferedWriter& w, const ExportContext&, uint64_t index, uint64_t ts, string_view name) override {
+    record(w, index, ts, name);
+  }
+  void row(BufferedWriter& w, const ExportContext&, uint64_t index, uint64_t ts, int number) override {
+    record(w, index, ts, string_view((const char*)&number, 4));
+  }
+
+private:
+  static void record(BufferedWriter& w, uint64_t index, uint64_t ts, string_view payload) {
+    char h[20];
+    uint32_t len = (uint32_t)(16 + payload.size());
+    memcpy(h, &len, 4);
+    memcpy(h + 4, &index, 8);
+    memcpy(h + 12, &ts, 8);
+    w.put(string_view(h, sizeof(h)));
+    w.put(payload);
+  }
+};
+
+static unique_ptr<Exporter> make_exporter(ExportFormat f) {
+  switch (f) {
+    case EXPORT_JSONL: return unique_ptr<Exporter>(new JsonlExporter());
+    case EXPORT_BIN: return unique_ptr<Exporter>(new BinaryExporter());
+    default: return unique_ptr<Exporter>(new CsvExporter());
+  }
+}
+
+// Writes history rows [from, count) through the chosen exporter; emit(i) writes row i.
+// A cancelled export puts the file back the way it was (removed / truncated).
+static bool export_rows(const string& filename, ExportFormat fmt, const ExportContext& ctx, bool append,
+                        size_t from, size_t count,
+                        const function<void(Exporter&, BufferedWriter&, size_t)>& emit,
+                        JobProgress* prog) {
+  int64_t before = -1;
+  if (append) {
+    ifstream probe(filename, ios::binary | ios::ate);
+    if (probe) before = (int64_t)probe.tellg();
+  }
+  unique_ptr<Exporter> ex = make_exporter(fmt);
+  BufferedWriter w;
+  if (!w.open(filename, append)) return false;
+  if (before <= 0) ex->begin(w, ctx);
+  if (prog) prog->total = count - from;
+
+  bool cancelled = false;
+  for (size_t i = from; i < count; i++) {
+    emit(*ex, w, i);
+    if (prog && ((i - from) & 4095) == 4095) {
+      prog->done = i - from + 1;
+      prog->bytes = w.bytes();
+      if (prog->cancel) { cancelled = true; break; }
+    }
+  }
+  bool ok = w.close();
+  if (cancelled) {
+    if (before < 0) remove(filename.c_str());
+    else sys_truncate(filename, (uint64_t)before);
+    return false;
+  }
+  if (prog) { prog->done = count - from; prog->bytes = w.bytes(); }
+  return ok;
+}
+
+static bool export_list_history(const ListState& st, uint32_t seed, ExportFormat fmt,
+                                const string& filename, size_t from, bool append,
+                                JobProgress* prog = nullptr) {
+  ExportContext ctx{false, seed};
+  return export_rows(filename, fmt, ctx, append, from, st.history.size(),
+    [&](Exporter& ex, BufferedWriter& w, size_t i) {
+      ex.row(w, ctx, i + 1, i < st.drawnAt.size() ? st.drawnAt[i] : 0, st.history[i]);
+    }, prog);
+}
+
+static bool export_range_history(const RangeState& st, uint32_t seed, ExportFormat fmt,
+                                 const string& filename, size_t from, bool append,
+                                 JobProgress* prog = nullptr) {
+  ExportContext ctx{true, seed};
+  return export_rows(filename, fmt, ctx, append, from, st.history.size(),
+    [&](Exporter& ex, BufferedWriter& w, size_t i) {
+      ex.row(w, ctx, i + 1, i < st.drawnAt.size() ? st.drawnAt[i] : 0, st.history[i]);
+    }, prog);
+}
+
+// FNV-1a, never 0 (0 marks an empty slot in the open-addressing tables)
+static uint64_t name_hash(const string& s) {
+  uint64_t h = 1469598103934665603ull;
+  for (unsigned char c : s) { h ^= c; h *= 1099511628211ull; }
+  return h ? h : 1;
+}
+
+// ---------------------- Session snapshot ----------------------
+// Versioned little-endian image of the whole session: fixed header, then
+// 8-byte aligned sections located by (offset, count) pairs. --resume maps the
+// file and validates it, copies mode B and the RNG out, and leaves mode A in
+// the mapping (ListImage) until list_ready() first needs it; the names are
+// strings in ListState, so that step is linear in the roster. A session that
+// exits without touching mode A copies its sections across unread.
+//   roster:   u64 offsets[count + 1] into the roster bytes that follow
+//   pool/history (mode A): u32 roster indices
+//   range pool/history (mode B): i32 values
+//   history timestamps (both modes): u64 unix ms
+//   rng: mt19937 state in its standard text form
+//   ops (v3, both modes): the undo log back to the last reset / state change,
+//     oldest first, so time travel and undo work the same after --resume
+//     (older ops hold whole states and are dropped; redo isn't kept)
+//     mode A: u8 kind | DRAW: u64 idx, u64 ts
+//                     | ADD: u64 allSize, u64 poolSize, u32 nAll, u32 nPool,
+//                            u32 roster indices[nPool]
+//       (an ADD's new roster names are roster[allSize, allSize + nAll))
+//     mode B: u8 kind | DRAW: u64 idx, i32 value, u64 ts, u8 fromPool | REPEAT_ON
+struct SnapshotHeader {
+  char magic[4];
+  uint32_t version;
+  uint64_t id;              // ties journal records to the snapshot they extend
+  uint64_t file_size;
+  uint64_t roster_off, roster_count;
+  uint64_t pool_off, pool_count;
+  uint64_t hist_off, hist_count;
+  uint64_t rpool_off, rpool_count;
+  uint64_t rhist_off, rhist_count;
+  uint64_t rng_off, rng_len;
+  int32_t range_n;
+  uint32_t range_norepeat;
+  uint64_t hist_ts_off;     // hist_count entries
+  uint64_t rhist_ts_off, rhist_ts_count;
+  uint32_t seed;
+  uint32_t reserved;
+  uint64_t list_ops_off, list_ops_len;    // v3
+  uint64_t range_ops_off, range_ops_len;  // v3
+};
+
+static const char SNAPSHOT_MAGIC[4] = {'D', 'R', 'W', 'S'};
+static const uint32_t SNAPSHOT_VERSION = 3;
+static const size_t SNAPSHOT_V2_HEADER = offsetof(SnapshotHeader, list_ops_off);  // still readable
+
+static void pad8(string& b) { b.resize((b.size() + 7) & ~(size_t)7, '\0'); }
+
+// index_of(name, out) maps a pool name to its roster index
+template <class IndexOf>
+static bool put_list_ops(string& out, const vector<ListOp>& undo, IndexOf&& index_of) {
+  size_t from = undo.size();
+  while (from > 0 && undo[from - 1].kind != ListOp::RESET) from--;
+  for (size_t i = from; i < undo.size(); i++) {
+    const ListOp& op = undo[i];
+    out.push_back((char)op.kind);
+    if (op.kind == ListOp::DRAW) {
+      put_u64(out, op.idx);
+      put_u64(out, op.ts);
+      continue;
+    }
+    put_u64(out, op.allSize);
+    put_u64(out, op.poolSize);
+    put_u32(out, (uint32_t)op.allAdded.size());
+    put_u32(out, (uint32_t)op.poolAdded.size());
+    uint32_t at;
+    for (auto &n : op.poolAdded) {
+      if (!index_of(n, at)) return false;
+      put_u32(out, at);
+    }
+  }
+  return true;
+}
+
+// Checks a mode A op stream against the state it ends in (sizes walked back
+// from the end, indices in range); with `all`, rebuilds the ops into `undo`.
+static bool read_list_ops(const char* p, uint64_t len, uint64_t rosterCount, uint64_t poolCount,
+                          uint64_t histCount, const vector<string>* all, vector<ListOp>* undo) {
+  vector<uint64_t> at;  // where each op starts
+  for (uint64_t q = 0; q < len;) {
+    at.push_back(q);
+    uint8_t kind = (uint8_t)p[q++];
+    if (kind == ListOp::DRAW) q += 16;
+    else if (kind == ListOp::ADD && len - q >= 24) q += 24 + 4 * (uint64_t)get_u32(p + q + 20);
+    else return false;
+    if (q > len) return false;
+  }
+  uint64_t a = rosterCount, pl = poolCount, h = histCount;
+  for (size_t i = at.size(); i-- > 0;) {
+    const char* r = p + at[i] + 1;
+    if (p[at[i]] == ListOp::DRAW) {
+      if (h == 0 || get_u64(r) > pl) return false;
+      h--;
+      pl++;
+      continue;
+    }
+    uint64_t allSize = get_u64(r), poolSize = get_u64(r + 8);
+    uint32_t nAll = get_u32(r + 16), nPool = get_u32(r + 20);
+    if (allSize + nAll != a || poolSize + nPool != pl) return false;
+    for (uint32_t j = 0; j < nPool; j++) if (get_u32(r + 24 + 4 * j) >= rosterCount) return false;
+    a = allSize;
+    pl = poolSize;
+  }
+  if (!undo) return true;
+  undo->reserve(at.size());
+  for (uint64_t s : at) {
+    const char* r = p + s + 1;
+    ListOp op;
+    op.kind = (ListOp::Kind)p[s];
+    if (op.kind == ListOp::DRAW) {
+      op.idx = (size_t)get_u64(r);
+      op.ts = get_u64(r + 8);
+    } else {
+      op.allSize = (size_t)get_u64(r);
+      op.poolSize = (size_t)get_u64(r + 8);
+      op.allAdded.assign(all->begin() + op.allSize, all->begin() + op.allSize + get_u32(r + 16));
+      uint32_t nPool = get_u32(r + 20);
+      op.poolAdded.reserve(nPool);
+      for (uint32_t j = 0; j < nPool; j++) op.poolAdded.push_back((*all)[get_u32(r + 24 + 4 * j)]);
+    }
+    undo->push_back(move(op));
+  }
+  return true;
+}
+
+static void put_range_ops(string& out, const vector<RangeOp>& undo) {
+  size_t from = undo.size();
+  while (from > 0 && undo[from - 1].kind != RangeOp::STATE) from--;
+  for (size_t i = from; i < undo.size(); i++) {
+    const RangeOp& op = undo[i];
+    out.push_back((char)op.kind);
+    if (op.kind != RangeOp::DRAW) continue;
+    put_u64(out, op.idx);
+    put_u32(out, (uint32_t)op.value);
+    put_u64(out, op.ts);
+    out.push_back(op.fromPool ? '\1' : '\0');
+  }
+}
+
+// Same for mode B: each undone draw must be the history's last value.
+static bool read_range_ops(const char* p, uint64_t len, const RangeState& st, vector<RangeOp>& undo) {
+  for (uint64_t q = 0; q < len;) {
+    RangeOp op;
+    op.kind = (RangeOp::Kind)p[q++];
+    if (op.kind == RangeOp::DRAW) {
+      if (len - q < 21) return false;
+      op.idx = (size_t)get_u64(p + q);
+      op.value = (int)get_u32(p + q + 8);
+      op.ts = get_u64(p + q + 12);
+      op.fromPool = p[q + 20] != 0;
+      q += 21;
+    } else if (op.kind != RangeOp::REPEAT_ON) {
+      return false;
+    }
+    undo.push_back(move(op));
+  }
+  uint64_t pl = st.pool.size(), h = st.history.size();
+  for (size_t i = undo.size(); i-- > 0;) {
+    const RangeOp& op = undo[i];
+    if (op.kind != RangeOp::DRAW) continue;
+    if (h == 0 || st.history[h - 1] != op.value || (op.fromPool && op.idx > pl)) return false;
+    h--;
+    if (op.fromPool) pl++;
+  }
+  return true;
+}
+
+// Copies a pending mode A image out of the snapshot into s.list.
+static void list_ready(Session& s) {
+  if (!s.listImage.map) return;
+  const ListImage& li = s.listImage;
+  const char* base = li.map->data();
+  const char* offs = base + li.roster_off;
+  const char* blob = offs + 8 * (li.roster_count + 1);
+
+  ListState nl;
+  nl.all.resize(li.roster_count);
+  for (uint64_t i = 0; i < li.roster_count; i++) {
+    uint64_t a = get_u64(offs + 8 * i), b = get_u64(offs + 8 * (i + 1));
+    nl.all[i].assign(blob + a, b - a);
+  }
+  auto read_indices = [&](uint64_t off, uint64_t count, vector<string>& dst) {
+    dst.resize(count);
+    for (uint64_t i = 0; i < count; i++) dst[i] = nl.all[get_u32(base + off + 4 * i)];
+  };
+  read_indices(li.pool_off, li.pool_count, nl.pool);
+  read_indices(li.hist_off, li.hist_count, nl.history);
+  nl.drawnAt.resize(li.hist_count);
+  if (li.hist_count) memcpy(nl.drawnAt.data(), base + li.hist_ts_off, li.hist_count * 8);
+  list_reindex(nl);
+  read_list_ops(base + li.ops_off, li.ops_len, li.roster_count, li.pool_count, li.hist_count, &nl.all, &nl.undo);
+  s.list = move(nl);
+  s.listImage = ListImage();
+}
+
+// Returns the new snapshot id, or 0 on failure. A mode A image still pending
+// from --resume is copied across byte for byte; its mapping is released
+// before the rename (Windows can't replace a mapped file), so this is the
+// last thing a session does.
+static uint64_t snapshot_save(const string& path, Session& s) {
+  const ListState& ls = s.list;
+  const RangeState& rs = s.range;
+  const ListImage& li = s.listImage;
+
+  SnapshotHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, SNAPSHOT_MAGIC, 4);
+  h.version = SNAPSHOT_VERSION;
+  h.id = now_unix_ms() ^ ((uint64_t)random_device{}() << 32);
+  if (h.id == 0) h.id = 1;
+
+  string out;
+  out.resize(sizeof(h));
+  if (li.map) {
+    const char* base = li.map->data();
+    auto copy = [&](uint64_t from, uint64_t bytes, uint64_t& off) {
+      off = out.size();
+      out.append(base + from, bytes);
+      pad8(out);
+    };
+    uint64_t blob = get_u64(base + li.roster_off + 8 * li.roster_count);
+    out.reserve(sizeof(h) + 8 * (li.roster_count + 1) + blob + 12 * (li.pool_count + li.hist_count)
+                + 4 * (rs.pool.size() + rs.history.size()) + 8192);
+    h.roster_count = li.roster_count;
+    copy(li.roster_off, 8 * (li.roster_count + 1) + blob, h.roster_off);
+    h.pool_count = li.pool_count;
+    copy(li.pool_off, 4 * li.pool_count, h.pool_off);
+    h.hist_count = li.hist_count;
+    copy(li.hist_off, 4 * li.hist_count, h.hist_off);
+    copy(li.hist_ts_off, 8 * li.hist_count, h.hist_ts_off);
+    h.list_ops_len = li.ops_len;
+    copy(li.ops_off, li.ops_len, h.list_ops_off);
+  } else {
+    // name -> roster index, open addressing over u32 slots (index + 1, 0 =
+    // empty): no node per name, which is what dominates saving a large roster
+    size_t mask = 1;
+    while (mask < ls.all.size() * 2) mask <<= 1;
+    vector<uint32_t> index(mask--, 0);
+    for (size_t i = 0; i < ls.all.size(); i++) {
+      size_t j = (size_t)name_hash(ls.all[i]) & mask;
+      while (index[j] && ls.all[index[j] - 1] != ls.all[i]) j = (j + 1) & mask;
+      if (!index[j]) index[j] = (uint32_t)i + 1;  // a repeated name keeps its first index
+    }
+
+    size_t bytes = 0;
+    for (auto &s : ls.all) bytes += s.size();
+    out.reserve(sizeof(h) + 8 * (ls.all.size() + 1) + bytes + 12 * (ls.pool.size() + ls.history.size())
+                + 4 * (rs.pool.size() + rs.history.size()) + 8192);
+
+    h.roster_off = out.size();
+    h.roster_count = ls.all.size();
+    uint64_t acc = 0;
+    put_u64(out, acc);
+    for (auto &s : ls.all) { acc += s.size(); put_u64(out, acc); }
+    for (auto &s : ls.all) out += s;
+    pad8(out);
+
+    auto index_of = [&](const string& s, uint32_t& at) {
+      size_t j = (size_t)name_hash(s) & mask;
+      while (index[j] && ls.all[index[j] - 1] != s) j = (j + 1) & mask;
+      at = index[j] - 1;
+      return index[j] != 0;
+    };
+    auto put_indices = [&](const vector<string>& v, uint64_t& off, uint64_t& count) {
+      off = out.size();
+      count = v.size();
+      uint32_t at;
+      for (auto &s : v) {
+        if (!index_of(s, at)) return false;
+        put_u32(out, at);
+      }
+      pad8(out);
+      return true;
+    };
+    if (!put_indices(ls.pool, h.pool_off, h.pool_count)) return 0;
+    if (!put_indices(ls.history, h.hist_off, h.hist_count)) return 0;
+
+    h.hist_ts_off = out.size();
+    for (size_t i = 0; i < ls.history.size(); i++) put_u64(out, i < ls.drawnAt.size() ? ls.drawnAt[i] : 0);
+
+    h.list_ops_off = out.size();
+    if (!put_list_ops(out, ls.undo, index_of)) return 0;
+    h.list_ops_len = out.size() - h.list_ops_off;
+    pad8(out);
+  }
+
+  h.rpool_off = out.size();
+  h.rpool_count = rs.pool.size();
+  out.append((const char*)rs.pool.data(), rs.pool.size() * sizeof(int));
+  pad8(out);
+  h.rhist_off = out.size();
+  h.rhist_count = rs.history.size();
+  out.append((const char*)rs.history.data(), rs.history.size() * sizeof(int));
+  pad8(out);
+
+  h.rhist_ts_off = out.size();
+  h.rhist_ts_count = rs.drawnAt.size();
+  out.append((const char*)rs.drawnAt.data(), rs.drawnAt.size() * sizeof(uint64_t));
+
+  h.range_ops_off = out.size();
+  put_range_ops(out, rs.undo);
+  h.range_ops_len = out.size() - h.range_ops_off;
+
+  ostringstream rngText;
+  rngText << s.rng;
+  h.rng_off = out.size();
+  h.rng_len = rngText.str().size();
+  out += rngText.str();
+
+  h.range_n = rs.N;
+  h.range_norepeat = rs.noRepeat ? 1 : 0;
+  h.seed = s.seed;
+  h.file_size = out.size();
+  memcpy(&out[0], &h, sizeof(h));
+
+  s.listImage = ListImage();
+  return write_file_atomic(path, out) ? h.id : 0;
+}
+
+// Returns the snapshot id, or 0 if the file is missing or invalid
+// (state is only touched once the whole file has been validated). Mode A is
+// left in the mapping, see list_ready().
+static uint64_t snapshot_load(const string& path, Session& s) {
+  shared_ptr<FileMap> fm = make_shared<FileMap>();
+  if (!fm->open(path) || fm->size() < SNAPSHOT_V2_HEADER) return 0;
+  const char* base = fm->data();
+  size_t size = fm->size();
+  SnapshotHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(&h, base, SNAPSHOT_V2_HEADER);
+  if (memcmp(h.magic, SNAPSHOT_MAGIC, 4) != 0 || h.file_size != size) return 0;
+  if (h.version == SNAPSHOT_VERSION) {
+    if (size < sizeof(h)) return 0;
+    memcpy(&h, base, sizeof(h));
+  } else if (h.version != 2) {
+    return 0;
+  }
+
+  auto fits = [&](uint64_t off, uint64_t count, uint64_t elem) {
+    return off <= size && count <= (size - off) / elem;
+  };
+  if (!fits(h.roster_off, h.roster_count + 1, 8) || !fits(h.pool_off, h.pool_count, 4) ||
+      !fits(h.hist_off, h.hist_count, 4) || !fits(h.rpool_off, h.rpool_count, 4) ||
+      !fits(h.rhist_off, h.rhist_count, 4) || !fits(h.rng_off, h.rng_len, 1) ||
+      !fits(h.hist_ts_off, h.hist_count, 8) || !fits(h.rhist_ts_off, h.rhist_ts_count, 8) ||
+      !fits(h.list_ops_off, h.list_ops_len, 1) || !fits(h.range_ops_off, h.range_ops_len, 1)) return 0;
+
+  // everything list_ready() will trust: ascending offsets, indices in range
+  const char* offs = base + h.roster_off;
+  uint64_t blob = h.roster_off + 8 * (h.roster_count + 1);
+  if (!fits(blob, get_u64(offs + 8 * h.roster_count), 1)) return 0;
+  for (uint64_t i = 0, prev = 0; i <= h.roster_count; i++) {
+    uint64_t next = get_u64(offs + 8 * i);
+    if (next < prev) return 0;
+    prev = next;
+  }
+  auto indices_ok = [&](uint64_t off, uint64_t count) {
+    for (uint64_t i = 0; i < count; i++) if (get_u32(base + off + 4 * i) >= h.roster_count) return false;
+    return true;
+  };
+  if (!indices_ok(h.pool_off, h.pool_count) || !indices_ok(h.hist_off, h.hist_count)) return 0;
+  if (!read_list_ops(base + h.list_ops_off, h.list_ops_len, h.roster_count, h.pool_count, h.hist_count,
+                     nullptr, nullptr)) return 0;
+
+  RangeState nr;
+  nr.N = h.range_n;
+  nr.noRepeat = h.range_norepeat != 0;
+  nr.pool.resize(h.rpool_count);
+  if (h.rpool_count) memcpy(nr.pool.data(), base + h.rpool_off, h.rpool_count * 4);
+  nr.history.resize(h.rhist_count);
+  if (h.rhist_count) memcpy(nr.history.data(), base + h.rhist_off, h.rhist_count * 4);
+  nr.drawnAt.resize(h.rhist_ts_count);
+  if (h.rhist_ts_count) memcpy(nr.drawnAt.data(), base + h.rhist_ts_off, h.rhist_ts_count * 8);
+  if (!read_range_ops(base + h.range_ops_off, h.range_ops_len, nr, nr.undo)) return 0;
+
+  mt19937 nrng;
+  istringstream rngText(string(base + h.rng_off, h.rng_len));
+  rngText >> nrng;
+  if (!rngText) return 0;
+
+  range_reindex(nr);
+  s.list = ListState();
+  s.listImage.map = fm;
+  s.listImage.roster_off = h.roster_off;
+  s.listImage.roster_count = h.roster_count;
+  s.listImage.pool_off = h.pool_off;
+  s.listImage.pool_count = h.pool_count;
+  s.listImage.hist_off = h.hist_off;
+  s.listImage.hist_count = h.hist_count;
+  s.listImage.hist_ts_off = h.hist_ts_off;
+  s.listImage.ops_off = h.list_ops_off;
+  s.listImage.ops_len = h.list_ops_len;
+  if (!s.range.pool.mapped()) s.range = move(nr);  // a mapped mode B already holds its own state
+  s.rng = nrng;
+  s.seed = h.seed;
+  s.snapshotId = h.id;
+  return h.id;
+}
+
+// ---------------------- Journal (write-ahead log) ----------------------
+// File: "DRWJ" + u32 version, then records
+//   u32 payload_len | u8 type | u64 unix_ms | payload | u32 crc32(type..payload)
+// Records are buffered by append() and written + synced together by commit()
+// (group commit: a file load is one record, a draw is one commit).
+enum JournalRec : uint8_t {
+  J_LIST_ADD = 1,    // u32 count, then count x (u32 len, bytes)
+  J_LIST_DRAW = 2,   // u32 pool index, then winner bytes
+  J_LIST_RESET = 3,
+  J_LIST_UNDO = 4,
+  J_LIST_REDO = 5,
+  J_RANGE_SET_N = 10,     // i32 N
+  J_RANGE_NOREPEAT = 11,  // u8 on
+  J_RANGE_DRAW = 12,      // u32 pool index, i32 value
+  J_RANGE_RESET = 13,
+  J_RANGE_UNDO = 14,
+  J_RANGE_REDO = 15,
+  J_SNAPSHOT_BASE = 20,   // u64 snapshot id, then snapshot path
+};
+
+static const char JOURNAL_MAGIC[4] = {'D', 'R', 'W', 'J'};
+static const uint32_t JOURNAL_VERSION = 3;
+
+static uint32_t crc32_update(uint32_t crc, const unsigned char* p, size_t n) {
+  static uint32_t table[256];
+  static bool ready = false;
+  if (!ready) {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : (c >> 1);
+      table[i] = c;
+    }
+    ready = true;
+  }
+  crc = ~crc;
+  for (size_t i = 0; i < n; i++) crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+static void journal_encode(string& buf, JournalRec type, const string& payload, uint64_t ts) {
+  size_t start = buf.size();
+  put_u32(buf, (uint32_t)payload.size());
+  buf.push_back((char)type);
+  put_u64(buf, ts);
+  buf += payload;
+  uint32_t crc = crc32_update(0, (const unsigned char*)buf.data() + start + 4, buf.size() - start - 4);
+  put_u32(buf, crc);
+}
+
+class Journal {
+public:
+  ~Journal() { close(); }
+
+  bool enabled() const { return fd_ >= 0; }
+  const string& path() const { return path_; }
+
+  bool open(const string& path) {
+    close();
+    path_ = path;
+    fd_ = sys_open_append(path);
+    if (fd_ < 0) return false;
+    ifstream probe(path, ios::binary | ios::ate);
+    if (probe && probe.tellg() == 0) {
+      string h(JOURNAL_MAGIC, 4);
+      put_u32(h, JOURNAL_VERSION);
+      if (!sys_write_all(fd_, h.data(), h.size()) || !sys_datasync(fd_)) { close(); return false; }
+    }
+    return true;
+  }
+
+  void close() {
+    if (fd_ < 0) return;
+    commit();
+    sys_close(fd_);
+    fd_ = -1;
+  }
+
+  // clean shutdown: nothing left to recover
+  void discard() {
+    if (fd_ < 0) return;
+    buf_.clear();
+    sys_close(fd_);
+    fd_ = -1;
+    remove(path_.c_str());
+  }
+
+  void append(JournalRec type, const string& payload, uint64_t ts = now_unix_ms()) {
+    if (fd_ < 0) return;
+    journal_encode(buf_, type, payload, ts);
+  }
+
+  // one write + one fdatasync for everything appended since the last commit
+  bool commit() {
+    if (fd_ < 0 || buf_.empty()) return true;
+    bool ok = sys_write_all(fd_, buf_.data(), buf_.size()) && sys_datasync(fd_);
+    buf_.clear();
+    return ok;
+  }
+
+  void log_list_add(const vector<string>& names) {
+    string p;
+    put_u32(p, (uint32_t)names.size());
+    for (auto &n : names) { put_u32(p, (uint32_t)n.size()); p += n; }
+    append(J_LIST_ADD, p);
+  }
+  void log_list_draw(size_t idx, const string& winner, uint64_t ts) {
+    string p;
+    put_u32(p, (uint32_t)idx);
+    p += winner;
+    append(J_LIST_DRAW, p, ts);
+  }
+  // mode B records are skipped while mode B is memory-mapped (it persists itself)
+  bool skipRange = false;
+
+  void log_range_set_n(int N) {
+    if (skipRange) return;
+    string p;
+    put_u32(p, (uint32_t)N);
+    append(J_RANGE_SET_N, p);
+  }
+  void log_range_norepeat(bool on) { if (!skipRange) append(J_RANGE_NOREPEAT, string(1, on ? '\1' : '\0')); }
+  void log_range_reset() { if (!skipRange) append(J_RANGE_RESET, ""); }
+  void log_range_undo(bool redo) { if (!skipRange) append(redo ? J_RANGE_REDO : J_RANGE_UNDO, ""); }
+  void log_range_draw(size_t idx, int value, uint64_t ts) {
+    if (skipRange) return;
+    string p;
+    put_u32(p, (uint32_t)idx);
+    put_u32(p, (uint32_t)value);
+    append(J_RANGE_DRAW, p, ts);
+  }
+  void log_snapshot_base(uint64_t id, const string& snapshotPath) {
+    string p;
+    put_u64(p, id);
+    p += snapshotPath;
+    append(J_SNAPSHOT_BASE, p);
+  }
+
+private:
+  string path_;
+  int fd_ = -1;
+  string buf_;
+};
+
+// Re-apply every intact record to fresh state. A torn or corrupt tail
+// (crash mid-write) is cut off so new records continue from the last good one.
+// A session resumed from a snapshot starts its journal with J_SNAPSHOT_BASE;
+// if that snapshot has since been rewritten (clean exit), it already holds
+// every later record, so the journal is rewritten to point at it instead.
+// Returns the number of records replayed, or -1 if the file is not a journal.
+static long journal_replay(const string& path, Session& s) {
+  ListState& ls = s.list;
+  RangeState& rs = s.range;
+  ifstream fin(path, ios::binary);
+  if (!fin) return 0;
+  string data((istreambuf_iterator<char>(fin)), istreambuf_iterator<char>());
+  fin.close();
+  if (data.empty()) return 0;
+  if (data.size() < 8 || memcmp(data.data(), JOURNAL_MAGIC, 4) != 0 ||
+      get_u32(data.data() + 4) != JOURNAL_VERSION) return -1;
+
+  const size_t HDR = 4 + 1 + 8;
+  size_t off = 8;
+  long count = 0;
+  while (off + HDR + 4 <= data.size()) {
+    const char* r = data.data() + off;
+    uint32_t len = get_u32(r);
+    if (len > data.size() - off - HDR - 4) break;
+    uint32_t crc = get_u32(r + HDR + len);
+    if (crc32_update(0, (const unsigned char*)r + 4, 1 + 8 + len) != crc) break;
+
+    uint8_t type = (uint8_t)r[4];
+    uint64_t ts = get_u64(r + 5);
+    const char* p = r + HDR;
+    bool ok = true;
+    if (rs.pool.mapped() && type >= J_RANGE_SET_N && type <= J_RANGE_REDO) type = 0xFF;
+    if (type >= J_LIST_ADD && type <= J_LIST_REDO) list_ready(s);
+    switch (type) {
+      case 0xFF: break;
+      case J_LIST_ADD: {
+        if (len < 4) { ok = false; break; }
+        uint32_t n = get_u32(p);
+        vector<string> names;
+        names.reserve(n);
+        size_t q = 4;
+        for (uint32_t i = 0; i < n && ok; i++) {
+          if (q + 4 > len) { ok = false; break; }
+          uint32_t sl = get_u32(p + q);
+          q += 4;
+          if (q + sl > len) { ok = false; break; }
+          names.emplace_back(p + q, sl);
+          q += sl;
+        }
+        if (ok) list_add_names(ls, names);
+        break;
+      }
+      case J_LIST_DRAW: {
+        if (len < 4) { ok = false; break; }
+        uint32_t idx = get_u32(p);
+        string name(p + 4, len - 4);
+        if (idx >= ls.pool.size() || ls.pool[idx] != name) { ok = false; break; }
+        list_apply_draw(ls, idx, ts);
+        break;
+      }
+      case J_LIST_RESET: list_reset(ls); break;
+      case J_LIST_UNDO: ok = list_undo(ls); break;
+      case J_LIST_REDO: ok = list_redo(ls); break;
+      case J_RANGE_SET_N:
+        if (len < 4) { ok = false; break; }
+        range_set_n(rs, (int)get_u32(p));
+        break;
+      case J_RANGE_NOREPEAT:
+        if (len < 1) { ok = false; break; }
+        range_set_norepeat(rs, p[0] != 0);
+        break;
+      case J_RANGE_DRAW: {
+        if (len < 8) { ok = false; break; }
+        uint32_t idx = get_u32(p);
+        int value = (int)get_u32(p + 4);
+        if (rs.noRepeat && (idx >= rs.pool.size() || rs.pool[idx] != value)) { ok = false; break; }
+        range_apply_draw(rs, idx, value, ts);
+        break;
+      }
+      case J_RANGE_RESET: range_reset(rs); break;
+      case J_RANGE_UNDO: ok = range_undo(rs); break;
+      case J_RANGE_REDO: ok = range_redo(rs); break;
+      case J_SNAPSHOT_BASE: {
+        if (len < 8 || count != 0) { ok = false; break; }
+        uint64_t want = get_u64(p);
+        uint64_t got = snapshot_load(string(p + 8, len - 8), s);
+        if (got == 0) { ok = false; break; }
+        if (got != want) {
+          string fresh(JOURNAL_MAGIC, 4);
+          put_u32(fresh, JOURNAL_VERSION);
+          string base;
+          put_u64(base, got);
+          base.append(p + 8, len - 8);
+          journal_encode(fresh, J_SNAPSHOT_BASE, base, now_unix_ms());
+          write_file_atomic(path, fresh);
+          return 1;
+        }
+        break;
+      }
+      default: ok = false; break;
+    }
+    if (!ok) break;
+    off += HDR + len + 4;
+    count++;
+  }
+
+  if (off < data.size()) sys_truncate(path, off);
+  return count;
+}
+
+// ---------------------- Winner registry ----------------------
+// Past winners across sessions (--registry PREFIX), kept on disk instead of RAM:
+//   PREFIX.log: "DRWL" + u32 version, then append-only records
+//     u32 name_len | u8 kind | u64 unix_ms | name | u32 crc32(kind..name)
+//   PREFIX.idx: RegistryIndexHeader, then an open-addressing hash table of
+//     RegistrySlot (one per distinct name), mmap'd and updated in place
+// The log is the source of truth. The index is marked dirty while open; one
+// that wasn't closed cleanly, or doesn't cover the whole log, is rebuilt from
+// the log on the next open. A lookup probes a slot or two and only reads the
+// log to confirm a 64-bit hash match. POSIX only, like the mapped int store.
+// What mode A does with names that won before
+enum PastWinnerPolicy { PAST_EXCLUDE, PAST_WEIGHT, PAST_IGNORE };
+
+enum RegistryRec : uint8_t {
+  REG_WIN = 1,
+  REG_RETRACT = 2,  // an undone draw
+};
+
+struct RegistryIndexHeader {
+  char magic[4];
+  uint32_t version;
+  uint64_t capacity;  // slots, power of two
+  uint64_t count;     // used slots
+  uint64_t log_size;  // log bytes reflected in the table
+  uint32_t clean;     // 1 after a clean close
+  uint32_t reserved;
+};
+
+struct RegistrySlot {
+  uint64_t hash;     // 0 = empty
+  uint64_t off;      // log offset of the first record of this name
+  uint64_t last_ts;  // latest win
+  uint32_t wins;     // wins minus retractions
+  uint32_t len;      // name length
+};
+
+static const char REGISTRY_LOG_MAGIC[4] = {'D', 'R', 'W', 'L'};
+static const char REGISTRY_IDX_MAGIC[4] = {'D', 'R', 'W', 'I'};
+static const uint32_t REGISTRY_VERSION = 1;
+
+class Registry {
+public:
+  Registry() = default;
+  Registry(const Registry&) = delete;
+  Registry& operator=(const Registry&) = delete;
+  ~Registry() { close(); }
+
+  PastWinnerPolicy policy = PAST_EXCLUDE;
+  double halfLifeDays = 365;  // PAST_WEIGHT decay
+
+  bool enabled() const { return hdr_ != nullptr; }
+  uint64_t names() const { return enabled() ? hdr_->count : 0; }
+
+  bool open(const string& prefix) {
+#ifdef _WIN32
+    (void)prefix;
+    return false;
+#else
+    close();
+    logFd_ = ::open((prefix + ".log").c_str(), O_RDWR | O_APPEND | O_CREAT, 0644);
+    if (logFd_ < 0) return false;
+    struct stat stt;
+    if (fstat(logFd_, &stt) != 0) { close(); return false; }
+    logSize_ = (uint64_t)stt.st_size;
+    if (logSize_ == 0) {
+      string h(REGISTRY_LOG_MAGIC, 4);
+      put_u32(h, REGISTRY_VERSION);
+      if (!sys_write_all(logFd_, h.data(), h.size()) || !sys_datasync(logFd_)) { close(); return false; }
+      logSize_ = h.size();
+    }
+    char lh[8];
+    if (::pread(logFd_, lh, 8, 0) != 8 || memcmp(lh, REGISTRY_LOG_MAGIC, 4) != 0 ||
+        get_u32(lh + 4) != REGISTRY_VERSION) { close(); return false; }
+
+    idxPath_ = prefix + ".idx";
+    if (!map_index(false)) {
+      if (!rebuild()) { close(); return false; }
+    }
+    hdr_->clean = 0;
+    msync(hdr_, sizeof(RegistryIndexHeader), MS_SYNC);
+    return true;
+#endif
+  }
+
+  void close() {
+#ifndef _WIN32
+    if (hdr_) {
+      hdr_->log_size = logSize_;
+      hdr_->clean = 1;
+      msync(hdr_, mapLen_, MS_SYNC);
+      munmap(hdr_, mapLen_);
+    }
+    if (idxFd_ >= 0) ::close(idxFd_);
+    if (logFd_ >= 0) ::close(logFd_);
+#endif
+    hdr_ = nullptr;
+    slots_ = nullptr;
+    idxFd_ = logFd_ = -1;
+    mapLen_ = 0;
+  }
+
+  // wins still standing for name (0 = never won); last win time in *lastTs
+  uint32_t wins(const string& name, uint64_t* lastTs = nullptr) const {
+    if (!enabled()) return 0;
+    const RegistrySlot* s = find(name_hash(name), name);
+    if (!s) return 0;
+    if (lastTs) *lastTs = s->last_ts;
+    return s->wins;
+  }
+
+  // the record is synced to the log before the index sees it (batch callers
+  // pass sync = false and call sync() once at the end)
+  bool record(const string& name, RegistryRec kind, uint64_t ts = now_unix_ms(), bool sync = true) {
+    if (!enabled()) return false;
+    string rec;
+    put_u32(rec, (uint32_t)name.size());
+    rec.push_back((char)kind);
+    put_u64(rec, ts);
+    rec += name;
+    put_u32(rec, crc32_update(0, (const unsigned char*)rec.data() + 4, rec.size() - 4));
+    if (!sys_write_all(logFd_, rec.data(), rec.size()) || (sync && !sys_datasync(logFd_))) return false;
+    uint64_t off = logSize_;
+    logSize_ += rec.size();
+    apply(name, off, kind, ts);
+    return true;
+  }
+
+  void sync() { if (logFd_ >= 0) sys_datasync(logFd_); }
+
+private:
+#ifndef _WIN32
+  // map PREFIX.idx; fresh = start an empty table with `cap` slots
+  bool map_index(bool fresh, uint64_t cap = 0) {
+    if (idxFd_ < 0) idxFd_ = ::open(idxPath_.c_str(), O_RDWR | O_CREAT, 0644);
+    if (idxFd_ < 0) return false;
+    size_t len;
+    if (fresh) {
+      len = sizeof(RegistryIndexHeader) + (size_t)cap * sizeof(RegistrySlot);
+      if (ftruncate(idxFd_, 0) != 0 || ftruncate(idxFd_, (off_t)len) != 0) return false;
+    } else {
+      struct stat stt;
+      if (fstat(idxFd_, &stt) != 0 || (size_t)stt.st_size < sizeof(RegistryIndexHeader)) return false;
+      len = (size_t)stt.st_size;
+    }
+    void* m = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, idxFd_, 0);
+    if (m == MAP_FAILED) return false;
+    RegistryIndexHeader* h = (RegistryIndexHeader*)m;
+    if (fresh) {
+      memcpy(h->magic, REGISTRY_IDX_MAGIC, 4);
+      h->version = REGISTRY_VERSION;
+      h->capacity = cap;
+      h->count = 0;
+      h->log_size = 0;
+      h->clean = 0;
+    } else if (memcmp(h->magic, REGISTRY_IDX_MAGIC, 4) != 0 || h->version != REGISTRY_VERSION ||
+               h->clean != 1 || h->log_size != logSize_ || h->capacity == 0 ||
+               (h->capacity & (h->capacity - 1)) != 0 ||
+               h->capacity > (len - sizeof(RegistryIndexHeader)) / sizeof(RegistrySlot)) {
+      munmap(m, len);
+      return false;
+    }
+    hdr_ = h;
+    slots_ = (RegistrySlot*)(h + 1);
+    mapLen_ = len;
+    return true;
+  }
+
+  void unmap_index() {
+    if (hdr_) munmap(hdr_, mapLen_);
+    hdr_ = nullptr;
+    slots_ = nullptr;
+    mapLen_ = 0;
+  }
+
+  // Re-derive the table from the log; a torn tail record is cut off.
+  bool rebuild() {
+    unmap_index();
+    FileMap log;
+    if (!log.open(idxPath_.substr(0, idxPath_.size() - 4) + ".log")) return false;
+    const char* d = log.data();
+    size_t n = log.size();
+    uint64_t cap = 1024;
+    while (cap < n / 16) cap *= 2;  // records are >= 17 bytes, so this leaves room
+    if (!map_index(true, cap)) return false;
+
+    const size_t HDR = 4 + 1 + 8;
+    size_t off = 8;
+    while (off + HDR + 4 <= n) {
+      uint32_t len = get_u32(d + off);
+      if (len > n - off - HDR - 4) break;
+      if (crc32_update(0, (const unsigned char*)d + off + 4, 1 + 8 + len) != get_u32(d + off + HDR + len)) break;
+      apply(string(d + off + HDR, len), off, (RegistryRec)d[off + 4], get_u64(d + off + 5));
+      off += HDR + len + 4;
+    }
+    if (off < n && ftruncate(logFd_, (off_t)off) != 0) return false;
+    logSize_ = off;
+    return true;
+  }
+
+  void grow() {
+    vector<RegistrySlot> old(slots_, slots_ + hdr_->capacity);
+    uint64_t cap = hdr_->capacity * 2;
+    unmap_index();
+    if (!map_index(true, cap)) { cerr << "registry 索引擴充失敗\n"; abort(); }
+    for (auto &s : old) {
+      if (!s.hash) continue;
+      slots_[probe_empty(s.hash)] = s;
+      hdr_->count++;
+    }
+  }
+#else
+  void grow() {}
+#endif
+
+  size_t probe_empty(uint64_t hash) const {
+    size_t mask = (size_t)hdr_->capacity - 1;
+    size_t i = (size_t)hash & mask;
+    while (slots_[i].hash) i = (i + 1) & mask;
+    return i;
+  }
+
+  bool name_is(const RegistrySlot& s, const string& name) const {
+    if (s.len != name.size()) return false;
+#ifdef _WIN32
+    return false;
+#else
+    string buf(s.len, '\0');
+    return ::pread(logFd_, &buf[0], s.len, (off_t)(s.off + 4 + 1 + 8)) == (ssize_t)s.len && buf == name;
+#endif
+  }
+
+  RegistrySlot* find(uint64_t hash, const string& name) const {
+    size_t mask = (size_t)hdr_->capacity - 1;
+    for (size_t i = (size_t)hash & mask; slots_[i].hash; i = (i + 1) & mask) {
+      if (slots_[i].hash == hash && name_is(slots_[i], name)) return &slots_[i];
+    }
+    return nullptr;
+  }
+
+  void apply(const string& name, uint64_t off, RegistryRec kind, uint64_t ts) {
+    uint64_t hash = name_hash(name);
+    RegistrySlot* s = find(hash, name);
+    if (kind == REG_RETRACT) {
+      if (s && s->wins > 0) s->wins--;
+      return;
+    }
+    if (!s) {
+      if ((hdr_->count + 1) * 10 > hdr_->capacity * 7) grow();
+      s = &slots_[probe_empty(hash)];
+      s->hash = hash;
+      s->off = off;
+      s->len = (uint32_t)name.size();
+      s->wins = 0;
+      hdr_->count++;
+    }
+    s->wins++;
+    s->last_ts = ts;
+  }
+
+  string idxPath_;
+  int logFd_ = -1;
+  int idxFd_ = -1;
+  uint64_t logSize_ = 0;
+  RegistryIndexHeader* hdr_ = nullptr;
+  RegistrySlot* slots_ = nullptr;
+  size_t mapLen_ = 0;
+};
+
+// Drop names that already won in an earlier session; returns how many.
+static size_t registry_filter(const Registry& reg, vector<string>& names) {
+  if (!reg.enabled() || reg.policy != PAST_EXCLUDE) return 0;
+  size_t before = names.size();
+  names.erase(remove_if(names.begin(), names.end(),
+                        [&](const string& n) { return reg.wins(n) > 0; }),
+              names.end());
+  return before - names.size();
+}
+
+// ---------------------- Fairness weights ----------------------
+// Under PAST_WEIGHT, a past winner's chance is scaled by
+//   w = 1 / (1 + wins * 2^(-days_since_last_win / half_life))
+// so frequent and recent winners are drawn less, and the effect fades out.
+// Weights are built once per pool (registry lookups into flat arrays, then
+// one branch-free pass the compiler can vectorize) and kept in a Fenwick
+// tree, so each draw samples and removes in O(log n), mirroring the pool's
+// swap-remove.
+class FairWeights {
+public:
+  size_t size() const { return w_.size(); }
+
+  void build(const Registry& reg, const vector<string>& pool, double halfLifeDays, uint64_t nowMs) {
+    size_t n = pool.size();
+    vector<float> wins(n), age(n);
+    for (size_t i = 0; i < n; i++) {
+      uint64_t last = 0;
+      wins[i] = (float)reg.wins(pool[i], &last);
+      age[i] = last && last < nowMs ? (float)((nowMs - last) / 86400000.0) : 0.0f;
+    }
+    float k = halfLifeDays > 0 ? (float)(-1.0 / halfLifeDays) : 0.0f;
+    w_.resize(n);
+    for (size_t i = 0; i < n; i++) w_[i] = 1.0f / (1.0f + wins[i] * exp2f(age[i] * k));
+
+    // O(n) Fenwick build: every node pushes its sum into its parent
+    tree_.assign(n + 1, 0.0);
+    for (size_t i = 1; i <= n; i++) {
+      tree_[i] += w_[i - 1];
+      size_t p = i + (i & (~i + 1));
+      if (p <= n) tree_[p] += tree_[i];
+    }
+  }
+
+  double weight(size_t idx) const { return w_[idx]; }
+  double total() const { return prefix(w_.size()); }
+
+  size_t sample(mt19937& rng) const {
+    size_t n = w_.size();
+    double u = uniform_real_distribution<double>(0.0, total())(rng);
+    size_t pos = 0, step = 1;
+    while (step * 2 <= n) step *= 2;
+    for (; step; step /= 2) {
+      if (pos + step <= n && tree_[pos + step] <= u) {
+        pos += step;
+        u -= tree_[pos];
+      }
+    }
+    return pos < n ? pos : n - 1;  // rounding can walk off the end
+  }
+
+  // same move as the pool: slot idx takes the last weight, the last slot goes
+  void remove(size_t idx) {
+    size_t last = w_.size() - 1;
+    if (idx != last) {
+      add(idx, w_[last] - w_[idx]);
+      w_[idx] = w_[last];
+    }
+    add(last, -w_[last]);
+    w_.pop_back();
+    tree_.pop_back();
+  }
+
+private:
+  void add(size_t idx, double d) {
+    for (size_t i = idx + 1; i < tree_.size(); i += i & (~i + 1)) tree_[i] += d;
+  }
+  double prefix(size_t n) const {
+    double s = 0;
+    for (size_t i = n; i; i -= i & (~i + 1)) s += tree_[i];
+    return s;
+  }
+
+  vector<float> w_;
+  vector<double> tree_;  // 1-based
+};
+
+// ---------------------- Slot sampling ----------------------
+// The first k slots of a uniform random permutation of [0, n): Fisher-Yates
+// over a sparse map, so O(k) however large n is. In order they are a uniform
+// draw of k distinct slots without replacement.
+static vector<size_t> sample_slots(size_t n, size_t k, mt19937& rng) {
+  k = min(k, n);
+  vector<size_t> order(k);
+  unordered_map<size_t, size_t> moved;  // slot -> value, where not the identity
+  moved.reserve(k * 2);
+  for (size_t i = 0; i < k; i++) {
+    size_t j = uniform_int_distribution<size_t>(i, n - 1)(rng);
+    auto vi = moved.find(i), vj = moved.find(j);
+    order[i] = vj == moved.end() ? j : vj->second;
+    moved[j] = vi == moved.end() ? i : vi->second;
+  }
+  return order;
+}
+
+// ---------------------- Concurrent claims ----------------------
+// k distinct slots of [0, n) handed out to any number of threads, one atomic
+// fetch-add each and no lock: ticket t maps to slot perm(t) of a keyed
+// permutation, so nothing is shuffled up front and each claimer does its own
+// work. perm is an 8-round Feistel network over the next even bit width with
+// splitmix64 round functions, cycle-walked back into [0, n) (a pseudo-random
+// permutation; callers keep small pools on sample_slots). The keys come from
+// the caller's RNG, so the ticket -> slot map, and with it the result, is the
+// same for any thread count.
+class ClaimPool {
+public:
+  static const size_t MIN_PARALLEL = 1 << 16;  // below this, sample_slots
+
+  ClaimPool(size_t n, size_t k, mt19937& rng) : n_(n), k_(min(k, n)) {
+    while (bits_ < 64 && (uint64_t(1) << bits_) < n) bits_ += 2;
+    half_ = bits_ / 2;
+    mask_ = (uint64_t(1) << half_) - 1;
+    for (auto &key : keys_) key = ((uint64_t)rng() << 32) | rng();
+  }
+
+  // thread-safe; false once k slots have been handed out
+  bool claim(size_t& slot, size_t& ticket) {
+    ticket = next_.fetch_add(1, memory_order_relaxed);
+    if (ticket >= k_) return false;
+    slot = (size_t)permute(ticket);
+    return true;
+  }
+
+  size_t size() const { return k_; }
+
+private:
+  static uint64_t mix(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+  }
+
+  uint64_t permute(uint64_t x) const {
+    do {
+      uint64_t l = x >> half_, r = x & mask_;
+      for (uint64_t key : keys_) {
+        uint64_t t = l ^ (mix(r ^ key) & mask_);
+        l = r;
+        r = t;
+      }
+      x = (l << half_) | r;
+    } while (x >= n_);  // at most 4x the domain, so ~2 rounds on average
+    return x;
+  }
+
+  size_t n_, k_;
+  unsigned bits_ = 2, half_ = 1;
+  uint64_t mask_ = 1;
+  uint64_t keys_[8];
+  alignas(64) atomic<size_t> next_{0};
+};
+
+// k slots from `threads` concurrent claimers, in ticket order
+static vector<size_t> claim_slots(ClaimPool& claims, unsigned threads) {
+  vector<size_t> slots(claims.size());
+  auto claimer = [&] {
+    size_t slot, ticket;
+    while (claims.claim(slot, ticket)) slots[ticket] = slot;
+  };
+  vector<thread> workers;
+  for (unsigned t = 1; t < threads; t++) workers.emplace_back(claimer);
+  claimer();
+  for (auto &w : workers) w.join();
+  return slots;
+}
+
+// the invariant every claimer relies on: no slot handed out twice
+static bool slots_distinct(const vector<size_t>& slots, size_t n) {
+  vector<bool> seen(n);
+  for (size_t s : slots) {
+    if (s >= n || seen[s]) return false;
+    seen[s] = true;
+  }
+  return true;
+}
+
+// ---------------------- Sharded name set ----------------------
+// Dedup for the parallel file loader: names are split into shards by hash, so
+// many parsing threads can insert at once, each locking only its own shard
+// (a name always lands in the same shard, so per-shard dedup is global).
+// It only exists while a file loads: drain_ordered hands the names over to
+// the ordinary mode A pool, which is what every draw samples from.
+class ShardedNameSet {
+public:
+  explicit ShardedNameSet(size_t shards = 0) {
+    if (shards == 0) shards = max(1u, thread::hardware_concurrency()) * 4;
+    for (size_t i = 0; i < shards; i++) shards_.emplace_back(new Shard());
+  }
+
+  // thread-safe; `order` is kept with the name (e.g. its file offset), the
+  // lowest one winning for repeats. false if the name was already registered.
+  bool add(string name, uint64_t order = 0) {
+    Shard& s = *shards_[hash<string>()(name) % shards_.size()];
+    lock_guard<mutex> lock(s.m);
+    auto ins = s.slot.emplace(name, s.names.size());
+    if (!ins.second) {
+      size_t at = ins.first->second;
+      if (order < s.names[at].first) s.names[at].first = order;
+      return false;
+    }
+    s.names.emplace_back(order, move(name));
+    s.live.fetch_add(1, memory_order_relaxed);
+    return true;
+  }
+
+  size_t size() const {
+    size_t n = 0;
+    for (auto &s : shards_) n += s->live.load(memory_order_relaxed);
+    return n;
+  }
+
+  // every live name, sorted by `order`; leaves the roster empty
+  vector<string> drain_ordered() {
+    vector<pair<uint64_t, string>> all;
+    all.reserve(size());
+    for (auto &s : shards_) {
+      lock_guard<mutex> lock(s->m);
+      for (auto &e : s->names) all.push_back(move(e));
+      s->names.clear();
+      s->slot.clear();
+      s->live = 0;
+    }
+    sort(all.begin(), all.end(), [](const pair<uint64_t, string>& a, const pair<uint64_t, string>& b) {
+      return a.first < b.first;
+    });
+    vector<string> out;
+    out.reserve(all.size());
+    for (auto &e : all) out.push_back(move(e.second));
+    return out;
+  }
+
+private:
+  struct alignas(64) Shard {
+    mutex m;
+    vector<pair<uint64_t, string>> names;
+    unordered_map<string, size_t> slot;  // name -> index in names
+    atomic<size_t> live{0};
+  };
+  vector<unique_ptr<Shard>> shards_;
+};
+
+// Big files are split at line boundaries and parsed by one thread per core,
+// all inserting into one sharded name set (duplicates are dropped as they
+// arrive). Names come back in file order, as read_names_file gives them.
+static bool read_names_parallel(const string& filename, vector<string>& names, JobProgress* prog = nullptr) {
+  FileMap file;
+  if (!file.open(filename)) return false;
+  const char* base = file.data();
+  size_t size = file.size();
+  if (prog) prog->total = size;
+
+  unsigned threads = max(1u, thread::hardware_concurrency());
+  vector<size_t> cut(threads + 1, size);
+  cut[0] = 0;
+  for (unsigned t = 1; t < threads; t++) {
+    size_t c = max(cut[t - 1], size / threads * t);
+    const char* nl = c < size ? (const char*)memchr(base + c, '\n', size - c) : nullptr;
+    cut[t] = nl ? (size_t)(nl - base) + 1 : size;
+  }
+
+  ShardedNameSet shards(threads * 4);
+  vector<thread> workers;
+  for (unsigned t = 0; t < threads; t++) {
+    workers.emplace_back([&, t] {
+      const char* p = base + cut[t];
+      const char* end = base + cut[t + 1];
+      const char* mark = p;
+      while (p < end) {
+        if (prog && prog->cancel) return;
+        const char* nl = (const char*)memchr(p, '\n', (size_t)(end - p));
+        const char* e = nl ? nl : end;
+        string line = trim(string(p, e));
+        if (!line.empty()) shards.add(move(line), (uint64_t)(p - base));
+        p = nl ? nl + 1 : end;
+        if (prog && (size_t)(p - mark) >= (1 << 20)) {
+          prog->done += (uint64_t)(p - mark);
+          prog->bytes += (uint64_t)(p - mark);
+          mark = p;
+        }
+      }
+      if (prog) { prog->done += (uint64_t)(p - mark); prog->bytes += (uint64_t)(p - mark); }
+    });
+  }
+  for (auto &w : workers) w.join();
+  if (prog && prog->cancel) return false;
+
+  names = shards.drain_ordered();
+  return true;
+}
+
+// ---------------------- Shared-memory pool ----------------------
+// One prize pool for several draw processes on the same machine (--shared
+// NAME, POSIX shared memory "/draw-NAME"). The creator shuffles the pool once
+// and publishes it; a draw in any process is then a single fetch_add on the
+// cursor in the shared header, so no two processes get the same entry, no
+// lock is ever held (a crashed terminal can't wedge the others) and the claims
+// in cursor order are a uniform draw without replacement.
+//   SharedPoolHeader | u64 claimedAt[count] | i32 claimedBy[count] (pid) |
+//   names: u64 offsets[count + 1], bytes   /   numbers: i32 values[count]
+// Republishing unlinks the old segment; processes pick up the new one on
+// their next draw.
+struct SharedPoolHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t kind;  // 1 = names, 2 = numbers
+  uint32_t reserved;
+  uint64_t id;    // changes on every publish
+  uint64_t count;
+  atomic<uint32_t> ready;  // set last, once everything else is written
+  uint32_t reserved2;
+  alignas(64) atomic<uint64_t> cursor;
+};
+
+static const char SHARED_POOL_MAGIC[4] = {'D', 'R', 'W', 'P'};
+static const uint32_t SHARED_POOL_VERSION = 1;
+static_assert(atomic<uint64_t>::is_always_lock_free, "shared pool needs address-free atomics");
+
+class SharedPool {
+public:
+  enum Kind : uint32_t { NAMES = 1, NUMBERS = 2 };
+
+  SharedPool() = default;
+  SharedPool(const SharedPool&) = delete;
+  SharedPool& operator=(const SharedPool&) = delete;
+  ~SharedPool() { close(); }
+
+  bool attached() const { return hdr_ != nullptr; }
+  Kind kind() const { return (Kind)hdr_->kind; }
+  uint64_t size() const { return hdr_->count; }
+  uint64_t claimed() const { return min(hdr_->cursor.load(memory_order_acquire), hdr_->count); }
+
+  static string shm_name(const string& name) { return "/draw-" + name; }
+
+  // shuffle and publish; replaces whatever pool had this name
+  bool publish_names(const string& name, const vector<string>& pool, mt19937& rng) {
+    vector<uint32_t> order(pool.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = (uint32_t)i;
+    shuffle(order.begin(), order.end(), rng);
+    size_t bytes = 0;
+    for (auto &n : pool) bytes += n.size();
+    if (!create(name, NAMES, pool.size(), 8 * (pool.size() + 1) + bytes)) return false;
+    uint64_t* offs = (uint64_t*)payload();
+    char* text = (char*)(offs + pool.size() + 1);
+    uint64_t at = 0;
+    for (size_t i = 0; i < order.size(); i++) {
+      const string& n = pool[order[i]];
+      offs[i] = at;
+      memcpy(text + at, n.data(), n.size());
+      at += n.size();
+    }
+    offs[pool.size()] = at;
+    hdr_->ready.store(1, memory_order_release);
+    return true;
+  }
+
+  bool publish_numbers(const string& name, int N, mt19937& rng) {
+    if (!create(name, NUMBERS, (uint64_t)N, 4 * (size_t)N)) return false;
+    int* vals = (int*)payload();
+    for (int i = 0; i < N; i++) vals[i] = i + 1;
+    shuffle(vals, vals + N, rng);
+    hdr_->ready.store(1, memory_order_release);
+    return true;
+  }
+
+  // map the current segment for name (no-op if it is the one already mapped)
+  bool open(const string& name) {
+#ifdef _WIN32
+    (void)name;
+    return false;
+#else
+    int fd = shm_open(shm_name(name).c_str(), O_RDWR, 0);
+    if (fd < 0) { close(); return false; }
+    struct stat stt;
+    if (fstat(fd, &stt) != 0 || (size_t)stt.st_size < sizeof(SharedPoolHeader)) { ::close(fd); close(); return false; }
+    if (hdr_ && stt.st_ino == ino_) { ::close(fd); return true; }
+    close();
+    void* m = mmap(nullptr, (size_t)stt.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (m == MAP_FAILED) return false;
+    SharedPoolHeader* h = (SharedPoolHeader*)m;
+    // the publisher may still be filling it in
+    for (int i = 0; i < 2000 && h->ready.load(memory_order_acquire) == 0; i++) this_thread::sleep_for(chrono::milliseconds(1));
+    if (memcmp(h->magic, SHARED_POOL_MAGIC, 4) != 0 || h->version != SHARED_POOL_VERSION ||
+        h->ready.load(memory_order_acquire) == 0 || layout_size(h->kind, h->count, 0) > (size_t)stt.st_size) {
+      munmap(m, (size_t)stt.st_size);
+      return false;
+    }
+    hdr_ = h;
+    len_ = (size_t)stt.st_size;
+    ino_ = stt.st_ino;
+    return true;
+#endif
+  }
+
+  void close() {
+#ifndef _WIN32
+    if (hdr_) munmap(hdr_, len_);
+#endif
+    hdr_ = nullptr;
+    len_ = 0;
+  }
+
+  static void unlink(const string& name) {
+#ifndef _WIN32
+    shm_unlink(shm_name(name).c_str());
+#else
+    (void)name;
+#endif
+  }
+
+  // the whole draw: one atomic add. false once everything has been claimed.
+  bool claim(uint64_t& ticket) {
+    uint64_t t = hdr_->cursor.fetch_add(1, memory_order_acq_rel);
+    if (t >= hdr_->count) return false;
+    claimedAt()[t] = now_unix_ms();
+#ifndef _WIN32
+    claimedBy()[t] = (int32_t)getpid();
+#else
+    claimedBy()[t] = (int32_t)GetCurrentProcessId();
+#endif
+    ticket = t;
+    return true;
+  }
+
+  string entry(uint64_t t) const {
+    if (kind() == NUMBERS) return to_string(((const int*)payload())[t]);
+    const uint64_t* offs = (const uint64_t*)payload();
+    const char* text = (const char*)(offs + hdr_->count + 1);
+    return string(text + offs[t], (size_t)(offs[t + 1] - offs[t]));
+  }
+  uint64_t claimed_at(uint64_t t) const { return claimedAt()[t]; }
+  int32_t claimed_by(uint64_t t) const { return claimedBy()[t]; }
+
+private:
+  static size_t layout_size(uint32_t kind, uint64_t count, size_t payloadLen) {
+    (void)kind;
+    return sizeof(SharedPoolHeader) + (size_t)count * (8 + 4) + ((size_t)count & 1) * 4 + payloadLen;
+  }
+  uint64_t* claimedAt() const { return (uint64_t*)(hdr_ + 1); }
+  int32_t* claimedBy() const { return (int32_t*)(claimedAt() + hdr_->count); }
+  char* payload() const {
+    return (char*)(claimedBy() + hdr_->count) + ((size_t)hdr_->count & 1) * 4;  // keep 8-byte alignment
+  }
+
+  bool create(const string& name, Kind kind, uint64_t count, size_t payloadLen) {
+#ifdef _WIN32
+    (void)name; (void)kind; (void)count; (void)payloadLen;
+    return false;
+#else
+    close();
+    unlink(name);
+    int fd = shm_open(shm_name(name).c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) return false;
+    size_t len = layout_size(kind, count, payloadLen);
+    if (ftruncate(fd, (off_t)len) != 0) { ::close(fd); unlink(name); return false; }
+    void* m = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    struct stat stt;
+    bool ok = m != MAP_FAILED && fstat(fd, &stt) == 0;
+    ::close(fd);
+    if (!ok) { if (m != MAP_FAILED) munmap(m, len); unlink(name); return false; }
+    hdr_ = new (m) SharedPoolHeader();  // fresh pages are zero: ready = 0, cursor = 0
+    memcpy(hdr_->magic, SHARED_POOL_MAGIC, 4);
+    hdr_->version = SHARED_POOL_VERSION;
+    hdr_->kind = kind;
+    hdr_->id = now_unix_ms();
+    hdr_->count = count;
+    len_ = len;
+    ino_ = stt.st_ino;
+    return true;
+#endif
+  }
+
+  SharedPoolHeader* hdr_ = nullptr;
+  size_t len_ = 0;
+#ifndef _WIN32
+  ino_t ino_ = 0;
+#endif
+};
+
+// ---------------------- Lottery tickets ----------------------
+// Bulk k-of-N tickets, one per line with the numbers ascending and zero-
+// padded ("03 11 17 25 38 44"). Each ticket is Floyd's subset sampler: k
+// bounded draws and no rejection loop. For N <= 64 the set is one 64-bit mask,
+// so the membership test is a bit test and the sorted output is a walk over
+// the set bits. Tickets come in blocks of 64k; each block has its own RNG
+// seeded from (seed, block), so the file is the same whatever the thread count.
+struct TicketSpec {
+  int k = 0, n = 0;
+  uint64_t count = 0;
+  uint32_t seed = 0;
+};
+
+// Lemire's multiply-shift, unbiased, for n < 2^32
+static inline uint32_t rand_below(mt19937& rng, uint32_t n) {
+  uint64_t m = (uint64_t)rng() * n;
+  if ((uint32_t)m < n) {
+    uint32_t floor = (uint32_t)(-n) % n;
+    while ((uint32_t)m < floor) m = (uint64_t)rng() * n;
+  }
+  return (uint32_t)(m >> 32);
+}
+
+static void ticket_block(const TicketSpec& sp, uint64_t block, uint64_t tickets, string& out) {
+  seed_seq ss{sp.seed, (uint32_t)block, (uint32_t)(block >> 32)};
+  mt19937 rng(ss);
+  int width = (int)to_string(sp.n).size();
+  out.clear();
+  out.reserve(tickets * sp.k * (width + 1));
+  char num[16];
+  auto put_num = [&](uint32_t v, bool last) {
+    char* e = num + sizeof(num);
+    char* p = e;
+    *--p = last ? '\n' : ' ';
+    for (int d = 0; d < width; d++, v /= 10) *--p = (char)('0' + v % 10);
+    out.append(p, e);
+  };
+
+  if (sp.n <= 64) {
+    for (uint64_t t = 0; t < tickets; t++) {
+      uint64_t mask = 0;
+      for (uint32_t j = sp.n - sp.k; j < (uint32_t)sp.n; j++) {
+        uint64_t bit = uint64_t(1) << rand_below(rng, j + 1);
+        mask |= (mask & bit) ? uint64_t(1) << j : bit;
+      }
+      for (int left = sp.k; mask; mask &= mask - 1) put_num((uint32_t)__builtin_ctzll(mask) + 1, --left == 0);
+    }
+    return;
+  }
+  // wider N: a bitmap for membership, then sort the k picks
+  vector<uint64_t> seen((sp.n + 63) / 64);
+  vector<uint32_t> pick(sp.k);
+  for (uint64_t t = 0; t < tickets; t++) {
+    for (int i = 0; i < sp.k; i++) {
+      uint32_t j = (uint32_t)(sp.n - sp.k + i);
+      uint32_t v = rand_below(rng, j + 1);
+      if ((seen[v / 64] >> (v % 64)) & 1) v = j;
+      seen[v / 64] |= uint64_t(1) << (v % 64);
+      pick[i] = v;
+    }
+    sort(pick.begin(), pick.end());
+    for (int i = 0; i < sp.k; i++) {
+      seen[pick[i] / 64] = 0;
+      put_num(pick[i] + 1, i + 1 == sp.k);
+    }
+  }
+}
+
+// Worker threads fill one block each per round; blocks are written in order.
+// The tickets go to PATH.tmp, renamed over PATH only once complete, so a
+// cancelled or failed run leaves no partial file (and any old one intact).
+static bool write_tickets(const TicketSpec& sp, const string& path, unsigned threads, JobProgress* prog = nullptr) {
+  const uint64_t BLOCK = 1 << 16;
+  string tmp = path + ".tmp";
+  BufferedWriter w(4 << 20);
+  if (!w.open(tmp, false)) return false;
+  auto fail = [&] { w.close(); remove(tmp.c_str()); return false; };
+  if (prog) prog->total = sp.count;
+  threads = max(1u, threads);
+  vector<string> bufs(threads);
+  uint64_t blocks = (sp.count + BLOCK - 1) / BLOCK;
+  for (uint64_t b = 0; b < blocks; b += threads) {
+    if (prog && prog->cancel) return fail();
+    unsigned used = (unsigned)min<uint64_t>(threads, blocks - b);
+    auto fill = [&](unsigned t) {
+      uint64_t blk = b + t;
+      ticket_block(sp, blk, min(BLOCK, sp.count - blk * BLOCK), bufs[t]);
+    };
+    vector<thread> workers;
+    for (unsigned t = 1; t < used; t++) workers.emplace_back(fill, t);
+    fill(0);
+    for (auto &th : workers) th.join();
+    for (unsigned t = 0; t < used; t++) {
+      w.put(bufs[t]);
+      if (prog) { prog->done += min(BLOCK, sp.count - (b + t) * BLOCK); prog->bytes += bufs[t].size(); }
+    }
+  }
+  if (!w.close() || !sys_replace(tmp, path)) { remove(tmp.c_str()); return false; }
+  return true;
+}
+
+// ---------------------- Combinatorial ranks ----------------------
+// A k-subset of 1..N drawn as one uniform rank in [0, C(N,k)) and decoded
+// with the combinatorial number system: the subset c_k > ... > c_1 (0-based)
+// has rank C(c_k,k) + ... + C(c_1,1). Publishing (N, k, rank) lets anyone
+// recompute the numbers. Ranks can be far beyond 64 bits, so they are kept
+// in a small bignum; the decode runs on unsigned __int128 when C(N,k) < 2^96
+// (room for the x N intermediate) and on the bignum otherwise.
+struct BigUint {
+  vector<uint32_t> w;  // little-endian limbs, no leading zeros (0 = empty)
+
+  static BigUint of(uint32_t x) { BigUint b; if (x) b.w.push_back(x); return b; }
+  bool zero() const { return w.empty(); }
+  size_t bits() const { return w.empty() ? 0 : 32 * (w.size() - 1) + (32 - __builtin_clz(w.back())); }
+  void trim() { while (!w.empty() && !w.back()) w.pop_back(); }
+
+  BigUint& operator*=(uint32_t m) {
+    uint64_t carry = 0;
+    for (auto &x : w) { carry += (uint64_t)x * m; x = (uint32_t)carry; carry >>= 32; }
+    if (carry) w.push_back((uint32_t)carry);
+    if (!m) w.clear();
+    return *this;
+  }
+  uint32_t divmod(uint32_t d) {
+    uint64_t rem = 0;
+    for (size_t i = w.size(); i-- > 0; ) {
+      uint64_t cur = (rem << 32) | w[i];
+      w[i] = (uint32_t)(cur / d);
+      rem = cur % d;
+    }
+    trim();
+    return (uint32_t)rem;
+  }
+  BigUint& operator/=(uint32_t d) { divmod(d); return *this; }
+  BigUint& operator-=(const BigUint& o) {  // requires *this >= o
+    int64_t borrow = 0;
+    for (size_t i = 0; i < w.size(); i++) {
+      int64_t cur = (int64_t)w[i] - borrow - (i < o.w.size() ? (int64_t)o.w[i] : 0);
+      borrow = cur < 0;
+      w[i] = (uint32_t)(cur + (borrow << 32));
+    }
+    trim();
+    return *this;
+  }
+  friend bool operator<(const BigUint& a, const BigUint& b) {
+    if (a.w.size() != b.w.size()) return a.w.size() < b.w.size();
+    for (size_t i = a.w.size(); i-- > 0; )
+      if (a.w[i] != b.w[i]) return a.w[i] < b.w[i];
+    return false;
+  }
+  friend bool operator>(const BigUint& a, const BigUint& b) { return b < a; }
+
+  string str() const {
+    if (zero()) return "0";
+    BigUint t = *this;
+    vector<uint32_t> parts;  // base 1e9, low first
+    while (!t.zero()) parts.push_back(t.divmod(1000000000));
+    string s = to_string(parts.back());
+    char buf[16];
+    for (size_t i = parts.size() - 1; i-- > 0; ) { snprintf(buf, sizeof(buf), "%09u", parts[i]); s += buf; }
+    return s;
+  }
+  static bool parse(const string& s, BigUint& out) {
+    out.w.clear();
+    if (s.empty()) return false;
+    for (char c : s) {
+      if (c < '0' || c > '9') return false;
+      out *= 10;
+      uint64_t carry = (uint64_t)(c - '0');
+      for (size_t i = 0; carry && i < out.w.size(); i++) { carry += out.w[i]; out.w[i] = (uint32_t)carry; carry >>= 32; }
+      if (carry) out.w.push_back((uint32_t)carry);
+    }
+    return true;
+  }
+};
+
+static BigUint binomial(int n, int k) {
+  BigUint c;
+  c.w.push_back(1);
+  if (k < 0 || k > n) { c.w.clear(); return c; }
+  k = min(k, n - k);
+  for (int i = 0; i < k; i++) { c *= (uint32_t)(n - i); c /= (uint32_t)(i + 1); }  // C(n, i+1), exact
+  return c;
+}
+
+// uniform in [0, bound): random limbs masked to bound's bit length, rejected
+// when too large (fewer than 2 tries expected)
+static BigUint random_below(const BigUint& bound, mt19937& rng) {
+  size_t nbits = bound.bits();
+  BigUint r;
+  do {
+    r.w.assign((nbits + 31) / 32, 0);
+    for (auto &x : r.w) x = rng();
+    if (nbits % 32) r.w.back() &= (uint32_t(1) << (nbits % 32)) - 1;
+    r.trim();
+  } while (!(r < bound));
+  return r;
+}
+
+// Walks c down from N once for all k positions, keeping B = C(c, i) by exact
+// small-integer ratios: O(N + k) word-sized steps, cheaper than searching
+// when k is close to N. Returns the numbers (1-based) in descending order.
+template<class U>
+static vector<int> unrank_walk(U r, U B, int n, int k) {
+  vector<int> out;
+  out.reserve(k);
+  int c = n;
+  for (int i = k; i >= 1; i--) {
+    do { B *= (uint32_t)(c - i); B /= (uint32_t)c; c--; } while (B > r);
+    out.push_back(c + 1);
+    if (c == i - 1) {  // B was C(i-1, i) = 0: the rest are forced
+      for (int j = c - 1; j >= 0; j--) out.push_back(j + 1);
+      break;
+    }
+    r -= B;
+    B *= (uint32_t)i;
+    B /= (uint32_t)(c - i + 1);  // C(c, i-1)
+  }
+  return out;
+}
+
+// C(c, i) into `out` if it is <= r; false (out unspecified) as soon as a
+// partial product passes r. C(c, 0..m) only grows for m <= c/2, so that
+// early exit is exact, and it keeps every intermediate below r x c.
+template<class U>
+static bool binom_le(int c, int i, const U& r, U& out) {
+  out = U::of(c >= i ? 1 : 0);
+  if (c < i) return true;
+  int m = min(i, c - i);
+  for (int j = 0; j < m; j++) {
+    out *= (uint32_t)(c - j);
+    out /= (uint32_t)(j + 1);
+    if (out > r) return false;
+  }
+  return !(out > r);
+}
+
+// For each position i = k..1, binary-search the largest c below the previous
+// one with C(c, i) <= r: O(k log N) binomials of at most min(i, c-i) steps.
+// Returns the numbers (1-based) in descending order.
+template<class U>
+static vector<int> unrank_search(U r, int n, int k) {
+  vector<int> out;
+  out.reserve(k);
+  int hi = n - 1;
+  U b;
+  for (int i = k; i >= 1; i--) {
+    int lo = i - 1;  // C(i-1, i) = 0 always fits
+    while (lo < hi) {
+      int mid = lo + (hi - lo + 1) / 2;
+      if (binom_le(mid, i, r, b)) lo = mid;
+      else hi = mid - 1;
+    }
+    binom_le(lo, i, r, b);
+    r -= b;
+    out.push_back(lo + 1);
+    hi = lo - 1;
+  }
+  return out;
+}
+
+#ifdef __SIZEOF_INT128__
+struct U128 {
+  unsigned __int128 v = 0;
+  static U128 of(uint32_t x) { U128 u; u.v = x; return u; }
+  U128& operator*=(uint32_t m) { v *= m; return *this; }
+  U128& operator/=(uint32_t d) { v /= d; return *this; }
+  U128& operator-=(const U128& o) { v -= o.v; return *this; }
+  friend bool operator>(const U128& a, const U128& b) { return a.v > b.v; }
+  static U128 from(const BigUint& b) {
+    U128 u;
+    for (size_t i = b.w.size(); i-- > 0; ) u.v = (u.v << 32) | b.w[i];
+    return u;
+  }
+};
+#endif
+
+// the k numbers (ascending) with the given rank; rank must be < C(n, k).
+// The walk only wins when k is close to N (k^2 log N past N).
+static vector<int> unrank_subset(const BigUint& rank, int n, int k) {
+  BigUint total = binomial(n, k);
+  bool walk = (double)k * k * log2((double)n + 1) > (double)n;
+  vector<int> out;
+#ifdef __SIZEOF_INT128__
+  if (total.bits() <= 96) out = walk ? unrank_walk(U128::from(rank), U128::from(total), n, k)
+                                     : unrank_search(U128::from(rank), n, k);
+  else
+#endif
+  out = walk ? unrank_walk(rank, total, n, k) : unrank_search(rank, n, k);
+  reverse(out.begin(), out.end());
+  return out;
+}
+
+// Applies a drawn subset as ordinary mode B draws (ascending). In no-repeat
+// mode the pool must still hold all of 1..N; slotOf follows each value as
+// swap-remove moves the last one into the drawn slot.
+static void range_draw_subset(RangeState& st, Journal& journal, const vector<int>& values) {
+  if (!st.noRepeat) {
+    for (int v : values) {
+      uint64_t ts = now_unix_ms();
+      range_apply_draw(st, 0, v, ts);
+      journal.log_range_draw(0, v, ts);
+    }
+    journal.commit();
+    return;
+  }
+  vector<uint32_t> slotOf(st.N + 1);
+  for (size_t i = 0; i < st.pool.size(); i++) slotOf[st.pool[i]] = (uint32_t)i;
+  for (int v : values) {
+    size_t slot = slotOf[v];
+    slotOf[st.pool.back()] = (uint32_t)slot;
+    uint64_t ts = now_unix_ms();
+    range_apply_draw(st, slot, v, ts);
+    journal.log_range_draw(slot, v, ts);
+  }
+  journal.commit();
+}
+
+// ---------------------- Animations ----------------------
+static int animated_pick_index(const vector<string>& pool, mt19937& rng, const string& label = "抽籤中",
+                               const FairWeights* weights = nullptr) {
+  uniform_int_distribution<int> dist(0, (int)pool.size() - 1);
+  auto pick = [&] { return weights ? (int)weights->sample(rng) : dist(rng); };
+
+  rlutil::setColor(rlutil::LIGHTMAGENTA);
+  cout << "按任意鍵開始抽籤..." << flush;
+  rlutil::setColor(rlutil::GREY);
+  rlutil::anykey();
+
+  ui_header(label, "候選人快速切換中...");
+  rlutil::setColor(rlutil::LIGHTCYAN);
+  cout << "\n";
+
+  int y = 14;
+  for (int i = 0; i < 26; i++) {
+    int idx = pick();
+    rlutil::locate(8, y);
+    rlutil::setColor(rlutil::LIGHTCYAN);
+    cout << ">>> ";
+    rlutil::setColor(rlutil::WHITE);
+    cout << pool[idx] << "                           " << flush;
+    rlutil::msleep(45 + (i / 10) * 10);
+  }
+
+  return pick();
+}
+
+static int animated_pick_number(int N, mt19937& rng, const string& label = "抽籤中") {
+  uniform_int_distribution<int> dist(1, N);
+
+  rlutil::setColor(rlutil::LIGHTMAGENTA);
+  cout << "按任意鍵開始抽籤..." << flush;
+  rlutil::setColor(rlutil::GREY);
+  rlutil::anykey();
+
+  ui_header(label, "號碼快速跳動中...");
+  int y = 14;
+
+  for (int i = 0; i < 32; i++) {
+    rlutil::locate(8, y);
+    rlutil::setColor(rlutil::LIGHTCYAN);
+    cout << ">>> ";
+    rlutil::setColor(rlutil::WHITE);
+    cout << dist(rng) << "                           " << flush;
+    rlutil::msleep(35 + (i / 12) * 10);
+  }
+
+  return dist(rng);
+}
+
+// ---------------------- Elimination grid ----------------------
+// "Last one standing": every name gets a cell in a grid below the header and
+// names drop out one at a time. Only the cell of the name just knocked out
+// (and the counter line) is repainted, so a few thousand names animate at
+// full speed. The winner is picked first (weighted under PAST_WEIGHT), then
+// everyone else is knocked out in random order from a swap-remove list.
+static int cp_width(uint32_t cp) {
+  // East Asian wide / fullwidth ranges (what names here actually use)
+  if ((cp >= 0x1100 && cp <= 0x115F) || (cp >= 0x2E80 && cp <= 0xA4CF) || (cp >= 0xAC00 && cp <= 0xD7A3) ||
+      (cp >= 0xF900 && cp <= 0xFAFF) || (cp >= 0xFE30 && cp <= 0xFE4F) || (cp >= 0xFF00 && cp <= 0xFF60) ||
+      (cp >= 0xFFE0 && cp <= 0xFFE6) || (cp >= 0x1F300 && cp <= 0x1FAFF) || (cp >= 0x20000 && cp <= 0x3FFFD))
+    return 2;
+  return 1;
+}
+
+// s cut to at most `width` terminal columns (never mid-character), space-padded
+// to exactly `width`; *used gets the columns taken by the text
+static string fit_cell(string_view s, int width, int* used = nullptr) {
+  string out;
+  int w = 0;
+  for (size_t i = 0; i < s.size(); ) {
+    unsigned char c = (unsigned char)s[i];
+    size_t len = c < 0x80 ? 1 : c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4;
+    if (i + len > s.size()) break;
+    uint32_t cp = len == 1 ? c : (c & (0x7F >> len));
+    for (size_t j = 1; j < len; j++) cp = (cp << 6) | ((unsigned char)s[i + j] & 0x3F);
+    int cw = cp_width(cp);
+    if (w + cw > width) break;
+    out.append(s.data() + i, len);
+    w += cw;
+    i += len;
+  }
+  if (used) *used = w;
+  out.append(width - w, ' ');
+  return out;
+}
+
+static size_t animated_elimination(const vector<string>& pool, mt19937& rng, const FairWeights* weights = nullptr) {
+  const uint32_t NONE = UINT32_MAX;
+  size_t n = pool.size();
+  size_t winner = weights ? weights->sample(rng) : uniform_int_distribution<size_t>(0, n - 1)(rng);
+  vector<uint32_t> others;
+  others.reserve(n - 1);
+  for (size_t i = 0; i < n; i++) if (i != winner) others.push_back((uint32_t)i);
+  auto knock_out = [&]() {
+    size_t j = uniform_int_distribution<size_t>(0, others.size() - 1)(rng);
+    uint32_t v = others[j];
+    others[j] = others.back();
+    others.pop_back();
+    return v;
+  };
+
+  rlutil::setColor(rlutil::LIGHTMAGENTA);
+  cout << "按任意鍵開始淘汰...（進行中按任意鍵直接看結果）" << flush;
+  rlutil::setColor(rlutil::GREY);
+  rlutil::anykey();
+  ui_header("淘汰賽", "逐一淘汰，最後留下的就是中籤者");
+
+  // rlutil reports garbage when stdout is not a terminal
+  int rows = rlutil::trows(), cols = rlutil::tcols();
+  if (rows < 20 || rows > 500) rows = 24;
+  if (cols < 40 || cols > 1000) cols = 80;
+  const int top = 12, gridRows = max(1, rows - top - 1), statusRow = rows;
+  int nameW = 4;
+  for (size_t i = 0; i < n && nameW < 16; i++) { int u; fit_cell(pool[i], 16, &u); nameW = max(nameW, u); }
+  const int cellW = nameW + 2;
+  const int perRow = max(1, (cols - 1) / cellW);
+  const size_t capacity = (size_t)perRow * gridRows;
+
+  auto status = [&](size_t alive) {
+    rlutil::locate(1, statusRow);
+    rlutil::setColor(rlutil::LIGHTCYAN);
+    cout << "剩餘 " << alive << " / " << n << " 人      " << flush;
+  };
+  // more names than cells: knock the excess out up front, then grid the rest
+  if (n > capacity) {
+    rlutil::setColor(rlutil::GREY);
+    cout << "人數超過畫面可顯示的 " << capacity << " 格，先淘汰到剩 " << capacity << " 人...\n" << flush;
+    while (others.size() + 1 > capacity) knock_out();
+    rlutil::msleep(600);
+    ui_header("淘汰賽", "逐一淘汰，最後留下的就是中籤者");
+  }
+
+  // survivors keep roster order in the grid
+  vector<uint32_t> shown(others);
+  shown.push_back((uint32_t)winner);
+  sort(shown.begin(), shown.end());
+  vector<uint32_t> cellOf(n, NONE);
+  for (size_t c = 0; c < shown.size(); c++) cellOf[shown[c]] = (uint32_t)c;
+  auto paint = [&](uint32_t idx, int color) {
+    uint32_t c = cellOf[idx];
+    rlutil::locate(1 + (int)(c % perRow) * cellW, top + (int)(c / perRow));
+    rlutil::setColor(color);
+    cout << fit_cell(pool[idx], nameW);
+  };
+
+  rlutil::hidecursor();
+  for (uint32_t idx : shown) paint(idx, rlutil::WHITE);
+  status(shown.size());
+
+  // roughly 6 s for the bulk of the grid, slowing down for the last few
+  const int base = clampi((int)(6000 / shown.size()), 1, 60);
+  bool skip = false;
+  while (!others.empty()) {
+    uint32_t out = knock_out();
+    size_t alive = others.size() + 1;
+    int delay = alive <= 3 ? 700 : alive <= 10 ? 300 : alive <= 30 ? 120 : base;
+    if (!skip && delay >= 120) {
+      paint(out, rlutil::LIGHTRED);
+      cout << flush;
+      rlutil::msleep(delay / 2);
+    }
+    paint(out, rlutil::DARKGREY);
+    status(alive);
+    if (!skip && kbhit()) { getch(); skip = true; }
+    if (!skip) rlutil::msleep(delay >= 120 ? delay / 2 : delay);
+  }
+  paint((uint32_t)winner, rlutil::YELLOW);
+  rlutil::locate(1, statusRow);
+  rlutil::setColor(rlutil::LIGHTGREEN);
+  cout << "🎉 最後留下：" << pool[winner] << "          " << flush;
+  rlutil::setColor(rlutil::GREY);
+  rlutil::showcursor();
+  rlutil::msleep(skip ? 300 : 1200);
+  return winner;
+}
+
+// ---------------------- Progress display ----------------------
+static string human_bytes(double b) {
+  static const char* units[] = {"B", "KB", "MB", "GB", "TB"};
+  int u = 0;
+  while (b >= 1024 && u < 4) { b /= 1024; u++; }
+  char tmp[32];
+  snprintf(tmp, sizeof(tmp), u == 0 ? "%.0f %s" : "%.1f %s", b, units[u]);
+  return tmp;
+}
+
+// Runs work() on a worker thread; this (UI) thread redraws a progress line
+// about 10 times a second and turns any keypress into a cancel request.
+// Returns work()'s result, and sets `cancelled` if the user stopped it.
+static bool run_with_progress(const string& label, const function<bool(JobProgress&)>& work, bool& cancelled) {
+  JobProgress prog;
+  atomic<bool> finished{false};
+  bool result = false;
+  thread worker([&]() {
+    result = work(prog);
+    finished = true;
+  });
+
+  auto t0 = chrono::steady_clock::now();
+  bool drawn = false;
+  while (!finished) {
+    rlutil::msleep(100);
+    if (finished) break;
+    if (!drawn) {
+      rlutil::setColor(rlutil::DARKGREY);
+      cout << "\n（按任意鍵取消）\n";
+      rlutil::setColor(rlutil::GREY);
+      drawn = true;
+    }
+    if (kbhit()) {
+      getch();
+      prog.cancel = true;
+    }
+
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    uint64_t done = prog.done, total = prog.total;
+    double frac = total ? min(1.0, (double)done / (double)total) : 0.0;
+    double rate = secs > 0 ? (double)prog.bytes / secs : 0.0;
+    const int W = 30;
+    int fill = (int)(frac * W);
+    string line = label + " [" + string(fill, '#') + string(W - fill, '-') + "] ";
+    line += to_string((int)(frac * 100)) + "%  " + human_bytes((double)prog.bytes) + "  " + human_bytes(rate) + "/s";
+    if (frac > 0 && frac < 1) line += "  剩餘約 " + to_string((int)(secs / frac - secs + 0.5)) + " 秒";
+    if (prog.cancel) line += "  取消中...";
+    rlutil::setColor(rlutil::LIGHTCYAN);
+    cout << "\r" << line << "        " << flush;
+    rlutil::setColor(rlutil::GREY);
+  }
+  worker.join();
+  if (drawn) cout << "\n";
+  cancelled = prog.cancel;
+  return result;
+}
+
+// ---------------------- Export dialog ----------------------
+// Option 6 in both modes. `mark` says what the previous export already
+// wrote; run(fmt, file, from, append) does the actual writing.
+static void ui_export_history(size_t total, ExportMark& mark,
+                              const function<bool(ExportFormat, const string&, size_t, bool, JobProgress&)>& run) {
+  ui_header("匯出已抽結果", "CSV（序號,結果）/ JSON Lines / 二進位");
+  ui_menu({
+    "1) CSV",
+    "2) JSON Lines（含時間戳、種子、抽籤序號）",
+    "3) 二進位（長度前綴，供程式讀取）",
+    "0) 返回"
+  }, "格式");
+  int fmt = 0; cin >> fmt;
+  if (fmt < EXPORT_CSV || fmt > EXPORT_BIN) return;
+
+  size_t from = min(mark.rows, total);
+  cout << "\n";
+  ui_menu({
+    "1) 完整輸出（覆寫檔案）",
+    mark.stale ? string("2) 附加（不可用：已復原上次匯出過的結果，請完整輸出）")
+               : "2) 附加上次匯出後新增的 " + to_string(total - from) + " 筆",
+    "0) 返回"
+  }, "方式");
+  int how = 0; cin >> how;
+  if (how != 1 && how != 2) return;
+  if (how == 2 && mark.stale) {
+    pause_anykey("上次匯出的檔案含有已復原的結果，附加會留下錯誤資料；請選完整輸出。按任意鍵返回...");
+    return;
+  }
+  if (how == 1) from = 0;
+
+  static const char* examples[] = {"", "result.csv", "result.jsonl", "result.bin"};
+  cout << "輸出檔名（例如 " << examples[fmt] << "）： " << flush;
+  string out;
+  cin >> out;
+  bool cancelled = false;
+  bool ok = run_with_progress("匯出中", [&](JobProgress& p) {
+    return run((ExportFormat)fmt, out, from, how == 2, p);
+  }, cancelled);
+  if (!ok) {
+    rlutil::setColor(rlutil::LIGHTRED);
+    if (cancelled) cout << "\n已取消匯出，檔案維持原狀：" << out << "\n";
+    else cout << "\n❌ 無法寫入檔案：" << out << "\n";
+    rlutil::setColor(rlutil::GREY);
+    pause_anykey();
+    return;
+  }
+  mark.rows = total;
+  mark.seq++;
+  if (how == 1) mark.stale = false;
+
+  rlutil::setColor(rlutil::LIGHTGREEN);
+  cout << "\n✅ 已輸出 " << (total - from) << " 筆（若 history 為空則為空檔）： " << out << "\n";
+  rlutil::setColor(rlutil::GREY);
+  pause_anykey();
+}
+
+// ---------------------- Batch selection ----------------------
+// Applies draws of the given original pool slots in order. Swap-remove moves
+// the last entry into the drawn slot, so follow those moves (sparse maps).
+static void list_take_slots(ListState& st, Journal& journal, Registry& registry,
+                            const vector<size_t>& slots, vector<string>& winners) {
+  unordered_map<size_t, size_t> where, origin;  // original slot <-> current slot
+  for (size_t o : slots) {
+    auto w = where.find(o);
+    size_t cur = w == where.end() ? o : w->second;
+    size_t last = st.pool.size() - 1;
+    auto l = origin.find(last);
+    size_t lastOrig = l == origin.end() ? last : l->second;
+    uint64_t ts = now_unix_ms();
+    string name = list_apply_draw(st, cur, ts);
+    journal.log_list_draw(cur, name, ts);
+    registry.record(name, REG_WIN, ts, false);
+    winners.push_back(move(name));
+    where[lastOrig] = cur;
+    origin[cur] = lastOrig;
+  }
+}
+
+// k winners in one go, each applied, journaled and registered like a single
+// draw (one group commit, one registry sync at the end). Under PAST_WEIGHT
+// they come from the fairness tree; large batches are claimed by one thread
+// per core from a ClaimPool, the rest come from one sparse Fisher-Yates.
+static vector<string> list_draw_many(Session& s, Journal& journal, Registry& registry, FairWeights& fair, size_t k) {
+  ListState& st = s.list;
+  mt19937& rng = s.rng;
+  const vector<string>& pool = st.pool;
+  k = min(k, pool.size());
+
+  vector<string> winners;
+  winners.reserve(k);
+  auto take = [&](size_t idx) {
+    uint64_t ts = now_unix_ms();
+    string w = list_apply_draw(st, idx, ts);
+    journal.log_list_draw(idx, w, ts);
+    registry.record(w, REG_WIN, ts, false);
+    winners.push_back(move(w));
+  };
+
+  if (registry.enabled() && registry.policy == PAST_WEIGHT) {
+    fair.build(registry, pool, registry.halfLifeDays, now_unix_ms());
+    for (size_t i = 0; i < k; i++) {
+      size_t idx = fair.sample(rng);
+      fair.remove(idx);
+      take(idx);
+    }
+  } else if (k >= ClaimPool::MIN_PARALLEL) {
+    ClaimPool claims(pool.size(), k, rng);
+    vector<size_t> slots = claim_slots(claims, max(1u, thread::hardware_concurrency()));
+    if (!slots_distinct(slots, pool.size())) { cerr << "同一位置被抽出兩次\n"; abort(); }
+    list_take_slots(st, journal, registry, slots, winners);
+  } else {
+    list_take_slots(st, journal, registry, sample_slots(pool.size(), k, rng), winners);
+  }
+  journal.commit();
+  registry.sync();
+  return winners;
+}
+
+// ---------------------- Prize-tier events ----------------------
+// An event script lists the tiers in reveal order, one `name = count` per
+// line; an optional `roster = FILE` line loads names into mode A first.
+//   # year-end party
+//   roster = staff.txt
+//   三獎 = 100
+//   二獎 = 10
+//   頭獎 = 3
+// The whole event is one batch selection of the summed count, cut into the
+// tiers in order, so nobody wins twice. Results go to a JSON file.
+struct EventTier {
+  string name;
+  size_t count = 0;
+  vector<string> winners;
+};
+
+static bool load_event(const string& path, string& roster, vector<EventTier>& tiers, string& err) {
+  ifstream fin(path);
+  if (!fin) { err = "無法開啟：" + path; return false; }
+  string line;
+  for (size_t lineNo = 1; getline(fin, line); lineNo++) {
+    line = trim(line);
+    if (line.empty() || line[0] == '#') continue;
+    size_t eq = line.find('=');
+    string key = eq == string::npos ? string() : trim(line.substr(0, eq));
+    string val = eq == string::npos ? string() : trim(line.substr(eq + 1));
+    if (key.empty() || val.empty()) { err = "第 " + to_string(lineNo) + " 行應為 名稱 = 數量"; return false; }
+    if (key == "roster") { roster = val; continue; }
+    EventTier t;
+    t.name = key;
+    auto res = from_chars(val.data(), val.data() + val.size(), t.count);
+    if (res.ec != errc() || res.ptr != val.data() + val.size() || t.count == 0) {
+      err = "第 " + to_string(lineNo) + " 行的數量無效：" + val;
+      return false;
+    }
+    tiers.push_back(move(t));
+  }
+  if (tiers.empty()) { err = "腳本裡沒有任何獎項"; return false; }
+  return true;
+}
+
+static bool write_event_result(const string& path, const string& eventPath, uint32_t seed,
+                               const vector<EventTier>& tiers) {
+  BufferedWriter w;
+  if (!w.open(path, false)) return false;
+  w.put("{\"event\":\"");
+  put_json_escaped(w, eventPath);
+  w.put("\",\"seed\":");
+  w.put_uint(seed);
+  w.put(",\"ts\":");
+  w.put_uint(now_unix_ms());
+  w.put(",\"tiers\":[\n");
+  for (size_t i = 0; i < tiers.size(); i++) {
+    w.put("  {\"tier\":\"");
+    put_json_escaped(w, tiers[i].name);
+    w.put("\",\"count\":");
+    w.put_uint(tiers[i].winners.size());
+    w.put(",\"winners\":[");
+    for (size_t j = 0; j < tiers[i].winners.size(); j++) {
+      w.put(j ? ",\"" : "\"");
+      put_json_escaped(w, tiers[i].winners[j]);
+      w.put('"');
+    }
+    w.put(i + 1 == tiers.size() ? "]}\n" : "]},\n");
+  }
+  w.put("]}\n");
+  return w.close();
+}
+
+// ---------------------- Team grouping ----------------------
+// Splits the whole mode A roster into K teams whose sizes differ by at most
+// one. A roster line may carry a group column after a tab or comma
+// ("王小明,業務部"); with stratify on, every group is spread as evenly as
+// possible over the teams. One shuffle, then member i of the (stratum-
+// ordered) permutation joins team i % K, so 1M people cost one pass.
+static string_view group_key(string_view name) {
+  size_t sep = name.find_first_of("\t,");
+  if (sep == string_view::npos) return string_view();
+  string_view key = name.substr(sep + 1);
+  while (!key.empty() && (key.front() == ' ' || key.front() == '\t')) key.remove_prefix(1);
+  while (!key.empty() && (key.back() == ' ' || key.back() == '\t' || key.back() == '\r')) key.remove_suffix(1);
+  return key;
+}
+
+// roster index -> group id; keys[id] is the group text ("" = no column)
+struct GroupIndex {
+  vector<string> keys;
+  vector<uint32_t> of;
+  vector<uint32_t> sizes;
+};
+
+static GroupIndex build_group_index(const vector<string>& names) {
+  GroupIndex gi;
+  unordered_map<string_view, uint32_t> ids;
+  gi.of.resize(names.size());
+  for (size_t i = 0; i < names.size(); i++) {
+    string_view key = group_key(names[i]);
+    auto it = ids.find(key);
+    if (it == ids.end()) {
+      it = ids.emplace(key, (uint32_t)gi.keys.size()).first;
+      gi.keys.emplace_back(key);
+      gi.sizes.push_back(0);
+    }
+    gi.of[i] = it->second;
+    gi.sizes[it->second]++;
+  }
+  return gi;
+}
+
+struct Partition {
+  size_t k = 0;
+  bool stratified = false;
+  vector<uint32_t> teamOf;            // roster index -> team
+  vector<vector<uint32_t>> members;   // team -> roster indices
+};
+
+static void partition_members(Partition& p) {
+  vector<uint32_t> count(p.k, 0);
+  for (uint32_t t : p.teamOf) count[t]++;
+  p.members.assign(p.k, {});
+  for (size_t t = 0; t < p.k; t++) p.members[t].reserve(count[t]);
+  for (size_t i = 0; i < p.teamOf.size(); i++) p.members[p.teamOf[i]].push_back((uint32_t)i);
+}
+
+static Partition partition_roster(const vector<string>& names, size_t k, bool stratify, mt19937& rng) {
+  Partition p;
+  p.k = k;
+  p.stratified = stratify;
+  size_t n = names.size();
+  vector<uint32_t> order(n);
+  for (size_t i = 0; i < n; i++) order[i] = (uint32_t)i;
+  shuffle(order.begin(), order.end(), rng);
+
+  if (stratify) {
+    // stable counting sort by group keeps the shuffled order inside each group
+    GroupIndex gi = build_group_index(names);
+    vector<size_t> start(gi.keys.size() + 1, 0);
+    for (size_t g = 0; g < gi.keys.size(); g++) start[g + 1] = start[g] + gi.sizes[g];
+    vector<uint32_t> sorted(n);
+    for (uint32_t i : order) sorted[start[gi.of[i]]++] = i;
+    order.swap(sorted);
+  }
+
+  // rotate the stride so the extra members of n % k don't always land on team 1
+  size_t offset = uniform_int_distribution<size_t>(0, k - 1)(rng);
+  p.teamOf.resize(n);
+  for (size_t i = 0; i < n; i++) p.teamOf[order[i]] = (uint32_t)((i + offset) % k);
+  partition_members(p);
+  return p;
+}
+
+// Constraint file for team grouping, one rule per line:
+//   max_per_team = 2        at most 2 of the same department in one team
+//   王小明 | 李小華          these two must not share a team
+// People are matched by the name before the group column.
+struct GroupConstraints {
+  size_t maxPerTeam = 0;  // 0 = no department cap
+  vector<pair<string, string>> apart;
+};
+
+static string_view person_name(string_view line) {
+  size_t sep = line.find_first_of("\t,");
+  if (sep != string_view::npos) line = line.substr(0, sep);
+  while (!line.empty() && line.back() == ' ') line.remove_suffix(1);
+  return line;
+}
+
+static bool load_group_constraints(const string& path, GroupConstraints& gc, string& err) {
+  ifstream fin(path);
+  if (!fin) { err = "無法開啟：" + path; return false; }
+  string line;
+  for (size_t lineNo = 1; getline(fin, line); lineNo++) {
+    line = trim(line);
+    if (line.empty() || line[0] == '#') continue;
+    size_t bar = line.find('|'), eq = line.find('=');
+    if (bar != string::npos) {
+      string a = trim(line.substr(0, bar)), b = trim(line.substr(bar + 1));
+      if (a.empty() || b.empty()) { err = "第 " + to_string(lineNo) + " 行應為 姓名 | 姓名"; return false; }
+      gc.apart.emplace_back(move(a), move(b));
+    }
+    else if (eq != string::npos && trim(line.substr(0, eq)) == "max_per_team") {
+      string val = trim(line.substr(eq + 1));
+      auto res = from_chars(val.data(), val.data() + val.size(), gc.maxPerTeam);
+      if (res.ec != errc() || res.ptr != val.data() + val.size() || gc.maxPerTeam == 0) {
+        err = "第 " + to_string(lineNo) + " 行的上限無效：" + val;
+        return false;
+      }
     }
-    if (!seen) out.push_back(x);
+    else { err = "第 " + to_string(lineNo) + " 行無法辨識：" + line; return false; }
   }
-  v.swap(out);
+  return true;
 }
 
-static void save_history_to_file(const vector<string>& history, const string& filename) {
-  ofstream fout(filename);
-  if (!fout) return;
-  for (size_t i = 0; i < history.size(); i++) {
-    fout << (i + 1) << "," << history[i] << "\n";
+struct ConstraintReport {
+  size_t unknown = 0;    // names in the file that are not in the roster
+  size_t conflicts = 0;  // apart pairs still sharing a team
+  size_t overCap = 0;    // people above the department cap, summed over teams
+  size_t swaps = 0;
+};
+
+// Starts from the (stratified, when capped) strided partition, then repairs
+// violations by local search: a violating person swaps with a random member
+// of another team when that lowers the total violation count (ties are taken
+// half the time to walk off plateaus). Swaps keep every team size unchanged.
+// Each team keeps a bitset over the constrained people, so "does x have a
+// partner in team u" is one bit test per partner.
+static Partition partition_constrained(const vector<string>& names, size_t k, const GroupConstraints& gc,
+                                       mt19937& rng, ConstraintReport& rep) {
+  const uint32_t NONE = UINT32_MAX;
+  const size_t n = names.size(), cap = gc.maxPerTeam;
+  Partition p = partition_roster(names, k, cap > 0, rng);
+  rep = ConstraintReport();
+
+  // apart pairs -> adjacency (CSR) over compact ids of the constrained people
+  unordered_map<string_view, uint32_t> byName;
+  byName.reserve(n);
+  for (size_t i = 0; i < n; i++) byName.emplace(person_name(names[i]), (uint32_t)i);
+  vector<uint32_t> cidOf(n, NONE), people;
+  vector<pair<uint32_t, uint32_t>> edges;
+  for (const auto& ab : gc.apart) {
+    auto a = byName.find(ab.first), b = byName.find(ab.second);
+    if (a == byName.end() || b == byName.end()) { rep.unknown++; continue; }
+    if (a->second == b->second) continue;
+    for (uint32_t x : {a->second, b->second})
+      if (cidOf[x] == NONE) { cidOf[x] = (uint32_t)people.size(); people.push_back(x); }
+    edges.emplace_back(a->second, b->second);
+  }
+  vector<uint32_t> adjStart(people.size() + 1, 0), adj(edges.size() * 2);
+  for (auto& e : edges) { adjStart[cidOf[e.first] + 1]++; adjStart[cidOf[e.second] + 1]++; }
+  for (size_t c = 0; c < people.size(); c++) adjStart[c + 1] += adjStart[c];
+  {
+    vector<uint32_t> fill(adjStart.begin(), adjStart.end() - 1);
+    for (auto& e : edges) { adj[fill[cidOf[e.first]]++] = e.second; adj[fill[cidOf[e.second]]++] = e.first; }
+  }
+
+  const size_t words = (people.size() + 63) / 64;
+  vector<uint64_t> bits(k * words, 0);
+  auto bit = [&](size_t t, uint32_t c) { return (bits[t * words + c / 64] >> (c % 64)) & 1; };
+  auto flip = [&](size_t t, uint32_t c) { bits[t * words + c / 64] ^= uint64_t(1) << (c % 64); };
+  for (uint32_t c = 0; c < people.size(); c++) flip(p.teamOf[people[c]], c);
+
+  GroupIndex gi;
+  if (cap) gi = build_group_index(names);
+  const size_t G = cap ? gi.keys.size() : 0;
+  // people without a department column are not a department: never capped
+  uint32_t noKey = NONE;
+  for (size_t g = 0; g < G; g++) if (gi.keys[g].empty()) noKey = (uint32_t)g;
+  auto capped = [&](uint32_t x) { return cap && gi.of[x] != noKey; };
+  vector<uint32_t> cnt(cap ? k * G : 0, 0);
+  for (size_t i = 0; i < n; i++) if (capped((uint32_t)i)) cnt[p.teamOf[i] * G + gi.of[i]]++;
+  auto excess = [&](uint32_t c) -> long { return c > cap ? (long)(c - cap) : 0; };
+
+  vector<uint32_t> posInTeam(n);
+  for (auto& m : p.members)
+    for (size_t j = 0; j < m.size(); j++) posInTeam[m[j]] = (uint32_t)j;
+
+  // partners of x in team t
+  auto partners = [&](uint32_t x, size_t t) -> long {
+    uint32_t c = cidOf[x];
+    if (c == NONE) return 0;
+    long r = 0;
+    for (uint32_t j = adjStart[c]; j < adjStart[c + 1]; j++) r += bit(t, cidOf[adj[j]]);
+    return r;
+  };
+  auto violating = [&](uint32_t x) {
+    size_t t = p.teamOf[x];
+    return partners(x, t) > 0 || (capped(x) && cnt[t * G + gi.of[x]] > cap);
+  };
+  // change in (conflicting pairs + people over cap) if x and y trade teams
+  auto delta = [&](uint32_t x, uint32_t y) -> long {
+    size_t t = p.teamOf[x], u = p.teamOf[y];
+    long linked = 0;
+    if (cidOf[x] != NONE && cidOf[y] != NONE)
+      for (uint32_t j = adjStart[cidOf[x]]; j < adjStart[cidOf[x] + 1]; j++) linked += adj[j] == y;
+    long d = partners(x, u) + partners(y, t) - 2 * linked - partners(x, t) - partners(y, u);
+    if (cap && gi.of[x] != gi.of[y]) {
+      if (capped(x)) {
+        uint32_t tx = cnt[t * G + gi.of[x]], ux = cnt[u * G + gi.of[x]];
+        d += excess(tx - 1) - excess(tx) + excess(ux + 1) - excess(ux);
+      }
+      if (capped(y)) {
+        uint32_t ty = cnt[t * G + gi.of[y]], uy = cnt[u * G + gi.of[y]];
+        d += excess(ty + 1) - excess(ty) + excess(uy - 1) - excess(uy);
+      }
+    }
+    return d;
+  };
+  auto swap_teams = [&](uint32_t x, uint32_t y) {
+    uint32_t t = p.teamOf[x], u = p.teamOf[y];
+    if (cidOf[x] != NONE) { flip(t, cidOf[x]); flip(u, cidOf[x]); }
+    if (cidOf[y] != NONE) { flip(u, cidOf[y]); flip(t, cidOf[y]); }
+    if (capped(x)) { cnt[t * G + gi.of[x]]--; cnt[u * G + gi.of[x]]++; }
+    if (capped(y)) { cnt[u * G + gi.of[y]]--; cnt[t * G + gi.of[y]]++; }
+    swap(p.members[t][posInTeam[x]], p.members[u][posInTeam[y]]);
+    swap(posInTeam[x], posInTeam[y]);
+    p.teamOf[x] = u;
+    p.teamOf[y] = t;
+    rep.swaps++;
+  };
+
+  // a department larger than cap * k cannot fit whatever the swaps do
+  long floorCap = 0;
+  for (size_t g = 0; g < G; g++)
+    if (g != noKey && gi.sizes[g] > cap * k) floorCap += (long)(gi.sizes[g] - cap * k);
+
+  const int TRIES = 16, MAX_STALE = 30;
+  uniform_int_distribution<size_t> otherTeam(0, k >= 2 ? k - 2 : 0);
+  vector<uint32_t> bad;
+  long best = numeric_limits<long>::max();
+  for (int stale = 0; k >= 2 && stale < MAX_STALE; ) {
+    long cost = 0;
+    for (uint32_t x : people) cost += partners(x, p.teamOf[x]);
+    cost /= 2;
+    for (uint32_t c : cnt) cost += excess(c);
+    if (cost <= floorCap) break;
+    if (cost < best) { best = cost; stale = 0; } else stale++;
+
+    // violators: the constrained people, plus everyone in an over-cap cell
+    bad.clear();
+    for (uint32_t x : people) if (violating(x)) bad.push_back(x);
+    for (size_t i = 0; cap && i < n; i++)
+      if (cidOf[i] == NONE && capped((uint32_t)i) && cnt[p.teamOf[i] * G + gi.of[i]] > cap) bad.push_back((uint32_t)i);
+    shuffle(bad.begin(), bad.end(), rng);
+
+    for (uint32_t x : bad) {
+      if (!violating(x)) continue;
+      long bestD = 1;
+      uint32_t bestY = NONE;
+      for (int a = 0; a < TRIES; a++) {
+        size_t u = otherTeam(rng);
+        if (u >= p.teamOf[x]) u++;
+        const vector<uint32_t>& m = p.members[u];
+        if (m.empty()) continue;
+        uint32_t y = m[uniform_int_distribution<size_t>(0, m.size() - 1)(rng)];
+        long d = delta(x, y);
+        if (d < bestD) { bestD = d; bestY = y; }
+      }
+      if (bestY != NONE && (bestD < 0 || rng() & 1)) swap_teams(x, bestY);
+    }
   }
+
+  for (uint32_t x : people) rep.conflicts += partners(x, p.teamOf[x]);
+  rep.conflicts /= 2;
+  for (uint32_t c : cnt) rep.overCap += excess(c);
+  return p;
 }
 
-// ---------------------- Animations ----------------------
-static int animated_pick_index(const vector<string>& pool, mt19937& rng, const string& label = "抽籤中") {
-  uniform_int_distribution<int> dist(0, (int)pool.size() - 1);
+// CSV: team,name (team numbers are 1-based)
+static bool write_partition(const string& path, const vector<string>& names, const Partition& p) {
+  BufferedWriter w;
+  if (!w.open(path, false)) return false;
+  for (size_t t = 0; t < p.members.size(); t++)
+    for (uint32_t i : p.members[t]) {
+      w.put_uint(t + 1);
+      w.put(',');
+      w.put(names[i]);
+      w.put('\n');
+    }
+  return w.close();
+}
 
-  rlutil::setColor(rlutil::LIGHTMAGENTA);
-  cout << "按任意鍵開始抽籤..." << flush;
-  rlutil::setColor(rlutil::GREY);
-  rlutil::anykey();
+// ---------------------- Stratified quota draws ----------------------
+// Winners per group of the mode A pool (group column as in team grouping):
+// either a fixed quota per group, or K winners split by group size with the
+// largest-remainder rule. The pool is indexed by group once, each stratum
+// is drawn on its own (own RNG, seeded from the session) on worker threads,
+// and all winners are then applied, journaled and registered as one batch.
+struct StratumDraw {
+  string key;
+  size_t size = 0;
+  vector<string> winners;
+};
 
-  ui_header(label, "候選人快速切換中...");
-  rlutil::setColor(rlutil::LIGHTCYAN);
-  cout << "\n";
+static vector<size_t> quota_proportional(const vector<uint32_t>& sizes, size_t k) {
+  size_t n = 0;
+  for (uint32_t c : sizes) n += c;
+  vector<size_t> q(sizes.size());
+  vector<pair<uint64_t, size_t>> rem;  // (remainder, group)
+  size_t given = 0;
+  for (size_t g = 0; g < sizes.size(); g++) {
+    uint64_t share = (uint64_t)k * sizes[g];
+    q[g] = (size_t)(share / n);
+    rem.emplace_back((uint64_t)(share % n), g);
+    given += q[g];
+  }
+  // ties go to the larger group, then the earlier one
+  sort(rem.begin(), rem.end(), [&](const pair<uint64_t, size_t>& a, const pair<uint64_t, size_t>& b) {
+    if (a.first != b.first) return a.first > b.first;
+    if (sizes[a.second] != sizes[b.second]) return sizes[a.second] > sizes[b.second];
+    return a.second < b.second;
+  });
+  for (size_t i = 0; given < k && i < rem.size(); i++, given++) q[rem[i].second]++;
+  return q;
+}
 
-  int y = 14;
-  for (int i = 0; i < 26; i++) {
-    int idx = dist(rng);
-    rlutil::locate(8, y);
-    rlutil::setColor(rlutil::LIGHTCYAN);
-    cout << ">>> ";
-    rlutil::setColor(rlutil::WHITE);
-    cout << pool[idx] << "                           " << flush;
-    rlutil::msleep(45 + (i / 10) * 10);
+// perGroup > 0: that many per group (all of a smaller group); otherwise k split by size
+static vector<StratumDraw> list_draw_stratified(Session& s, Journal& journal, Registry& registry,
+                                                size_t perGroup, size_t k) {
+  ListState& st = s.list;
+  GroupIndex gi = build_group_index(st.pool);
+  const size_t G = gi.keys.size();
+
+  vector<size_t> quota(G);
+  if (perGroup) for (size_t g = 0; g < G; g++) quota[g] = min<size_t>(perGroup, gi.sizes[g]);
+  else quota = quota_proportional(gi.sizes, min(k, st.pool.size()));
+
+  // pool slots grouped by stratum (counting sort)
+  vector<size_t> start(G + 1, 0);
+  for (size_t g = 0; g < G; g++) start[g + 1] = start[g] + gi.sizes[g];
+  vector<size_t> slots(st.pool.size());
+  {
+    vector<size_t> fill(start.begin(), start.end() - 1);
+    for (size_t i = 0; i < st.pool.size(); i++) slots[fill[gi.of[i]]++] = i;
   }
 
-  return dist(rng);
+  vector<uint32_t> seeds(G);
+  for (auto &sd : seeds) sd = s.rng();
+  atomic<size_t> next{0};
+  auto work = [&] {
+    for (size_t g; (g = next.fetch_add(1)) < G; ) {
+      mt19937 rng(seeds[g]);
+      // partial Fisher-Yates: the first quota[g] slots of the stratum are its winners
+      for (size_t i = 0; i < quota[g]; i++) {
+        size_t j = uniform_int_distribution<size_t>(start[g] + i, start[g + 1] - 1)(rng);
+        swap(slots[start[g] + i], slots[j]);
+      }
+    }
+  };
+  unsigned threads = max(1u, min(thread::hardware_concurrency(), (unsigned)min<size_t>(G, st.pool.size() / 65536 + 1)));
+  vector<thread> workers;
+  for (unsigned t = 1; t < threads; t++) workers.emplace_back(work);
+  work();
+  for (auto &w : workers) w.join();
+
+  vector<size_t> picked;
+  for (size_t g = 0; g < G; g++) picked.insert(picked.end(), slots.begin() + start[g], slots.begin() + start[g] + quota[g]);
+  vector<StratumDraw> out(G);
+  for (size_t g = 0; g < G; g++) { out[g].key = gi.keys[g]; out[g].size = gi.sizes[g]; }
+
+  vector<string> winners;
+  winners.reserve(picked.size());
+  list_take_slots(st, journal, registry, picked, winners);
+  journal.commit();
+  registry.sync();
+
+  size_t at = 0;
+  for (size_t g = 0; g < G; g++) {
+    out[g].winners.assign(make_move_iterator(winners.begin() + at), make_move_iterator(winners.begin() + at + quota[g]));
+    at += quota[g];
+  }
+  return out;
 }
 
-static int animated_pick_number(int N, mt19937& rng, const string& label = "抽籤中") {
-  uniform_int_distribution<int> dist(1, N);
+// ---------------------- Mode A: List draw ----------------------
+static void mode_list_draw(Session& s, Journal& journal, Registry& registry) {
+  if (s.listImage.map) {
+    ui_header("模式 A：名單抽籤", "從快照載入名單中...");
+    cout << flush;
+    list_ready(s);
+  }
+  ListState& st = s.list;
+  mt19937& rng = s.rng;
+  const vector<string>& all = st.all;
+  const vector<string>& pool = st.pool;
+  const vector<string>& history = st.history;
+  FairWeights fair;        // PAST_WEIGHT only; rebuilt after anything but a draw
+  bool fairDirty = true;
 
-  rlutil::setColor(rlutil::LIGHTMAGENTA);
-  cout << "按任意鍵開始抽籤..." << flush;
-  rlutil::setColor(rlutil::GREY);
-  rlutil::anykey();
+  while (true) {
+    ui_header("模式 A：名單抽籤（不重複）", "可手動輸入 / 讀檔；抽到會從池子移除");
+    ui_status_bar(
+      "狀態：全部 " + to_string(all.size()) + " 人 / 可抽 " + to_string(pool.size()) + " 人 / 已抽 " + to_string(history.size()) + " 人",
+      registry.enabled() ? "A 模式（歷屆 " + to_string(registry.names()) + " 人）" : "A 模式"
+    );
+
+    vector<string> items = {
+      "1) 手動輸入名單（逐行輸入，空行結束）",
+      "2) 從檔案載入名單（每行一個名字）",
+      "3) 抽一位（不重複）",
+      "4) 查看名單（全部 / 剩餘 / 已抽）",
+      "5) 重置抽籤（已抽回池子）",
+      "6) 匯出已抽結果（CSV / JSON Lines / 二進位）",
+      "7) 復原上一步（" + to_string(st.undo.size()) + "）",
+      "8) 重做（" + to_string(st.redo.size()) + "）",
+      "9) 一次抽出多位",
+      "10) 執行獎項腳本（多個獎項一次抽完）",
+    };
+    if (registry.enabled())
+      items.push_back(string("11) 歷屆中籤者：") +
+        (registry.policy == PAST_EXCLUDE ? "載入時排除" :
+         registry.policy == PAST_WEIGHT ? "依次數與遠近降低機率" : "不處理") + "（切換）");
+    items.push_back("12) 分層配額抽籤（依部門各抽幾位）");
+    items.push_back("13) 淘汰賽（逐一淘汰，最後留下的中籤）");
+    items.push_back("0) 返回主選單");
+    ui_menu(items);
+
+    int op;
+    cin >> op;
+
+    if (op == 0) return;
+    if (op != 3 && op != 4 && op != 6 && op != 13) fairDirty = true;
+
+    if (op == 1) {
+      ui_header("手動輸入名單", "一行一個名字；輸入空行結束");
+      clear_input_line();
+
+      string line;
+      vector<string> names;
+      while (true) {
+        rlutil::setColor(rlutil::LIGHTCYAN);
+        cout << "> " << flush;
+        rlutil::setColor(rlutil::GREY);
+
+        getline(cin, line);
+        line = trim(line);
+        if (line.empty()) break;
+
+        names.push_back(line);
+      }
+
+      size_t excluded = registry_filter(registry, names);
+      int added = list_add_names(st, names);
+      if (!names.empty()) {
+        journal.log_list_add(names);
+        journal.commit();
+      }
+
+      rlutil::setColor(rlutil::LIGHTGREEN);
+      cout << "\n新增 " << added << " 筆；目前可抽 " << pool.size() << " 人。\n";
+      if (excluded) cout << "（已排除 " << excluded << " 位歷屆中籤者）\n";
+      rlutil::setColor(rlutil::GREY);
+      pause_anykey();
+    }
+    else if (op == 2) {
+      ui_header("從檔案載入名單", "每行一個名字，例如 names.txt / classA.txt");
+      cout << "請輸入檔名/路徑： " << flush;
+
+      string filename;
+      cin >> filename;
+
+      // names are collected on the side and only applied once the whole file is read
+      vector<string> names;
+      bool cancelled = false;
+      bool ok = run_with_progress("載入中", [&](JobProgress& p) {
+        // large files are parsed on every core
+        ifstream probe(filename, ios::binary | ios::ate);
+        if (thread::hardware_concurrency() > 1 && probe && probe.tellg() >= (streamoff)(8 << 20))
+          return read_names_parallel(filename, names, &p);
+        return read_names_file(filename, names, &p);
+      }, cancelled);
+      if (!ok) {
+        rlutil::setColor(rlutil::LIGHTRED);
+        if (cancelled) cout << "\n已取消載入，名單未變更。\n";
+        else cout << "\n❌ 無法開啟檔案：" << filename << "\n";
+        rlutil::setColor(rlutil::GREY);
+        pause_anykey();
+        continue;
+      }
+
+      size_t excluded = registry_filter(registry, names);
+      int added = list_add_names(st, names);
+      if (!names.empty()) {
+        journal.log_list_add(names);
+        journal.commit();
+      }
+
+      rlutil::setColor(rlutil::LIGHTGREEN);
+      cout << "\n已載入 " << added << " 筆；目前可抽 " << pool.size() << " 人。\n";
+      if (excluded) cout << "（已排除 " << excluded << " 位歷屆中籤者）\n";
+      rlutil::setColor(rlutil::GREY);
+      pause_anykey();
+    }
+    else if (op == 3 || op == 13) {
+      if (pool.empty()) {
+        ui_header(op == 13 ? "淘汰賽" : "抽一位", "池子已空，請先輸入名單或重置");
+        rlutil::setColor(rlutil::LIGHTRED);
+        cout << "⚠️ 沒有人可以抽。\n";
+        rlutil::setColor(rlutil::GREY);
+        pause_anykey();
+        continue;
+      }
+
+      bool weighted = registry.enabled() && registry.policy == PAST_WEIGHT;
+      if (weighted && (fairDirty || fair.size() != pool.size())) {
+        fair.build(registry, pool, registry.halfLifeDays, now_unix_ms());
+        fairDirty = false;
+      }
+      int idx = op == 13 ? (int)animated_elimination(pool, rng, weighted ? &fair : nullptr)
+                         : animated_pick_index(pool, rng, "抽籤中（名單）", weighted ? &fair : nullptr);
+      if (weighted) fair.remove(idx);
+      uint64_t ts = now_unix_ms();
+      string winner = list_apply_draw(st, idx, ts);
+      journal.log_list_draw(idx, winner, ts);
+      journal.commit();
+      registry.record(winner, REG_WIN, ts);
+
+      ui_header("抽籤結果", op == 13 ? "最後留下的就是你！" : "恭喜中籤！");
+      rlutil::setColor(rlutil::LIGHTGREEN);
+      cout << "\n🎉 中籤：";
+      rlutil::setColor(rlutil::YELLOW);
+      cout << winner << "\n";
+      rlutil::setColor(rlutil::GREY);
+      cout << "剩餘可抽： " << pool.size() << " 人\n";
+
+      pause_anykey();
+    }
+    else if (op == 9) {
+      ui_header("一次抽出多位", "全部一起抽出，不會重複");
+      if (pool.empty()) {
+        rlutil::setColor(rlutil::LIGHTRED);
+        cout << "⚠️ 沒有人可以抽。\n";
+        rlutil::setColor(rlutil::GREY);
+        pause_anykey();
+        continue;
+      }
+      cout << "要抽出幾位（1 ~ " << pool.size() << "）： " << flush;
+      size_t k = 0; cin >> k;
+      if (k < 1) continue;
+      k = min(k, pool.size());
+
+      vector<string> winners = list_draw_many(s, journal, registry, fair, k);
+
+      ui_header("抽籤結果", "共抽出 " + to_string(winners.size()) + " 位");
+      const size_t SHOW = 200;
+      rlutil::setColor(rlutil::YELLOW);
+      for (size_t i = 0; i < winners.size() && i < SHOW; i++) cout << (history.size() - winners.size() + i + 1) << ". " << winners[i] << "\n";
+      rlutil::setColor(rlutil::GREY);
+      if (winners.size() > SHOW) cout << "...（完整名單請用匯出）\n";
+      cout << "剩餘可抽： " << pool.size() << " 人\n";
+      pause_anykey();
+    }
+    else if (op == 10) {
+      ui_header("執行獎項腳本", "每行「獎項 = 數量」，可加「roster = 名單檔」");
+      cout << "腳本檔名/路徑： " << flush;
+      string path;
+      cin >> path;
+
+      string roster, err;
+      vector<EventTier> tiers;
+      if (!load_event(path, roster, tiers, err)) {
+        pause_anykey("❌ " + err + "，按任意鍵返回...");
+        continue;
+      }
+      if (!roster.empty()) {
+        vector<string> names;
+        if (!read_names_file(roster, names)) {
+          pause_anykey("❌ 無法開啟名單：" + roster + "，按任意鍵返回...");
+          continue;
+        }
+        registry_filter(registry, names);
+        list_add_names(st, names);
+        if (!names.empty()) {
+          journal.log_list_add(names);
+          journal.commit();
+        }
+      }
+
+      size_t total = 0;
+      for (auto &t : tiers) total += t.count;
+      rlutil::setColor(rlutil::WHITE);
+      for (auto &t : tiers) cout << "  " << t.name << "：" << t.count << " 位\n";
+      rlutil::setColor(rlutil::GREY);
+      cout << "共 " << total << " 位，可抽 " << pool.size() << " 人\n";
+      if (total > pool.size()) {
+        pause_anykey("⚠️ 人數不足，按任意鍵返回...");
+        continue;
+      }
+
+      cout << "結果檔（Enter = event_result.json）： " << flush;
+      clear_input_line();
+      string out;
+      getline(cin, out);
+      out = trim(out);
+      if (out.empty()) out = "event_result.json";
+      cout << "逐一揭曉？（1 = 是，0 = 直接顯示結果）： " << flush;
+      int staged = 0; cin >> staged;
+
+      // the whole event in one pass, then cut into tiers in script order
+      vector<string> winners = list_draw_many(s, journal, registry, fair, total);
+      size_t at = 0;
+      for (auto &t : tiers) {
+        t.winners.assign(make_move_iterator(winners.begin() + at), make_move_iterator(winners.begin() + at + t.count));
+        at += t.count;
+      }
+      bool saved = write_event_result(out, path, s.seed, tiers);
+
+      const size_t SHOW = 200;
+      if (staged == 1) {
+        for (size_t i = 0; i < tiers.size(); i++) {
+          ui_header("🎉 " + tiers[i].name, "共 " + to_string(tiers[i].count) + " 位");
+          rlutil::setColor(rlutil::YELLOW);
+          int delay = (int)max<size_t>(5, min<size_t>(150, 3000 / tiers[i].count));
+          for (size_t j = 0; j < tiers[i].winners.size() && j < SHOW; j++) {
+            cout << "  " << (j + 1) << ". " << tiers[i].winners[j] << "\n" << flush;
+            rlutil::msleep(delay);
+          }
+          rlutil::setColor(rlutil::GREY);
+          if (tiers[i].count > SHOW) cout << "  ...（完整名單見結果檔）\n";
+          if (i + 1 < tiers.size()) pause_anykey("按任意鍵揭曉下一個獎項...");
+        }
+      } else {
+        ui_header("抽籤結果", "共 " + to_string(total) + " 位");
+        for (auto &t : tiers) {
+          rlutil::setColor(rlutil::LIGHTGREEN);
+          cout << t.name << "（" << t.count << " 位）\n";
+          rlutil::setColor(rlutil::YELLOW);
+          for (size_t j = 0; j < t.winners.size() && j < SHOW; j++) cout << "  " << (j + 1) << ". " << t.winners[j] << "\n";
+          if (t.count > SHOW) cout << "  ...\n";
+        }
+        rlutil::setColor(rlutil::GREY);
+      }
+      if (saved) cout << "\n✅ 結果已寫入：" << out << "\n";
+      else cout << "\n❌ 無法寫入結果檔：" << out << "\n";
+      pause_anykey();
+    }
+    else if (op == 12) {
+      ui_header("分層配額抽籤", "名單可用「姓名,部門」帶分組欄位；每個部門各自抽、不重複");
+      if (pool.empty()) {
+        rlutil::setColor(rlutil::LIGHTRED);
+        cout << "⚠️ 沒有人可以抽。\n";
+        rlutil::setColor(rlutil::GREY);
+        pause_anykey();
+        continue;
+      }
+      cout << "1) 每組固定人數  2) 總數依各組人數比例分配： " << flush;
+      int how = 0; cin >> how;
+      size_t perGroup = 0, k = 0;
+      if (how == 1) {
+        cout << "每組抽幾位： " << flush;
+        cin >> perGroup;
+        if (perGroup < 1) continue;
+      } else if (how == 2) {
+        cout << "共抽幾位（1 ~ " << pool.size() << "）： " << flush;
+        cin >> k;
+        if (k < 1) continue;
+      } else {
+        pause_anykey("無效選項，按任意鍵返回...");
+        continue;
+      }
+
+      vector<StratumDraw> strata = list_draw_stratified(s, journal, registry, perGroup, k);
+
+      size_t total = 0;
+      for (auto &g : strata) total += g.winners.size();
+      ui_header("抽籤結果", "共 " + to_string(strata.size()) + " 組、" + to_string(total) + " 位");
+      const size_t SHOW = 200;
+      size_t shown = 0;
+      for (auto &g : strata) {
+        if (shown >= SHOW) break;
+        rlutil::setColor(rlutil::LIGHTGREEN);
+        cout << (g.key.empty() ? "（未分組）" : g.key) << "（" << g.winners.size() << " / " << g.size << " 人）\n";
+        rlutil::setColor(rlutil::YELLOW);
+        for (size_t j = 0; j < g.winners.size() && shown < SHOW; j++, shown++) cout << "  " << (j + 1) << ". " << g.winners[j] << "\n";
+      }
+      rlutil::setColor(rlutil::GREY);
+      if (total > shown) cout << "...（完整名單請用匯出）\n";
+      cout << "剩餘可抽： " << pool.size() << " 人\n";
+      pause_anykey();
+    }
+    else if (op == 4) {
+      ui_header("查看名單", "可查看：全部 / 剩餘 / 已抽 / 某次抽籤前的池子");
+      ui_menu({
+        "1) 全部名單",
+        "2) 剩餘可抽",
+        "3) 已抽記錄",
+        "4) 時光回溯：第 k 次抽籤前的池子",
+        "5) 查詢某人是否中籤",
+        "0) 返回"
+      }, "選項");
+
+      int t; cin >> t;
+      if (t == 0) continue;
+
+      if (t == 5) {
+        ui_header("查詢中籤", "輸入名字查詢；輸入空行結束");
+        clear_input_line();
+        string line;
+        while (true) {
+          rlutil::setColor(rlutil::LIGHTCYAN);
+          cout << "> " << flush;
+          rlutil::setColor(rlutil::GREY);
+          if (!getline(cin, line)) break;
+          line = trim(line);
+          if (line.empty()) break;
+
+          auto it = st.drawnPos.find(line);
+          if (it != st.drawnPos.end()) {
+            rlutil::setColor(rlutil::LIGHTGREEN);
+            cout << "  🎉 " << line << "：第 " << (it->second + 1) << " 位中籤\n";
+          } else {
+            rlutil::setColor(rlutil::DARKGREY);
+            cout << "  " << line << "：未中籤\n";
+          }
+          if (uint32_t w = registry.wins(line)) {
+            rlutil::setColor(rlutil::YELLOW);
+            cout << "    （歷屆累計中籤 " << w << " 次）\n";
+          }
+          rlutil::setColor(rlutil::GREY);
+        }
+        continue;
+      }
+
+      auto print_list = [&](const vector<string>& v, const string& emptyMsg) {
+        cout << "\n";
+        if (v.empty()) {
+          rlutil::setColor(rlutil::DARKGREY);
+          cout << emptyMsg << "\n";
+          rlutil::setColor(rlutil::GREY);
+          return;
+        }
+        rlutil::setColor(rlutil::WHITE);
+        for (size_t i = 0; i < v.size(); i++) cout << (i + 1) << ". " << v[i] << "\n";
+        rlutil::setColor(rlutil::GREY);
+      };
+
+      if (t == 1) print_list(all, "（目前沒有任何名單）");
+      else if (t == 2) print_list(pool, "（池子已空）");
+      else if (t == 3) print_list(history, "（尚未抽出任何人）");
+      else if (t == 4) {
+        if (history.empty()) {
+          print_list(history, "（尚未抽出任何人）");
+        } else {
+          cout << "\n第幾次抽籤前（1 ~ " << history.size() << "）： " << flush;
+          size_t k = 0; cin >> k;
+          if (k >= 1 && k <= history.size()) {
+            PoolAt<string> at = list_pool_at(st, k);
+            rlutil::setColor(rlutil::LIGHTGREEN);
+            cout << "\n第 " << k << " 次抽籤前池子共 " << at.count << " 人（該次抽出：" << history[k - 1] << "）\n";
+            if (!at.exact) {
+              rlutil::setColor(rlutil::DARKGREY);
+              cout << "（此次抽籤早於保存的操作紀錄，之後新增的名單無法扣除）\n";
+            }
+            // streamed from the overlay: the view itself is never copied out
+            size_t shown = 0;
+            rlutil::setColor(rlutil::WHITE);
+            at.for_each(pool, [&](const string& x) { cout << ++shown << ". " << x << "\n"; });
+            rlutil::setColor(rlutil::DARKGREY);
+            if (shown == 0) cout << "（池子已空）\n";
+            rlutil::setColor(rlutil::GREY);
+          }
+        }
+      }
+
+      pause_anykey();
+    }
+    else if (op == 5) {
+      list_reset(st);
+      journal.append(J_LIST_RESET, "");
+      journal.commit();
+      ui_header("重置完成", "已將已抽回池子");
+      rlutil::setColor(rlutil::LIGHTGREEN);
+      cout << "可抽：" << pool.size() << " 人\n";
+      rlutil::setColor(rlutil::GREY);
+      pause_anykey();
+    }
+    else if (op == 6) {
+      ui_export_history(history.size(), st.exported,
+        [&](ExportFormat fmt, const string& out, size_t from, bool append, JobProgress& p) {
+          return export_list_history(st, s.seed, fmt, out, from, append, &p);
+        });
+    }
+    else if (op == 11 && registry.enabled()) {
+      registry.policy = (PastWinnerPolicy)((registry.policy + 1) % 3);
+    }
+    else if (op == 7 || op == 8) {
+      bool redo = op == 8;
+      vector<ListOp>& log = redo ? st.redo : st.undo;
+      if (log.empty()) {
+        pause_anykey(redo ? "沒有可重做的步驟，按任意鍵返回..." : "沒有可復原的步驟，按任意鍵返回...");
+        continue;
+      }
+      const ListOp& last = log.back();
+      string what, drawn;
+      if (last.kind == ListOp::ADD) what = "新增名單 " + to_string(last.poolAdded.size()) + " 筆";
+      else if (last.kind == ListOp::RESET) what = "重置";
+      else {
+        drawn = redo ? pool[last.idx] : history.back();
+        what = "抽出 " + drawn;
+      }
 
-  ui_header(label, "號碼快速跳動中...");
-  int y = 14;
+      if (redo) list_redo(st);
+      else list_undo(st);
+      journal.append(redo ? J_LIST_REDO : J_LIST_UNDO, "");
+      journal.commit();
+      // the registry is append-only: an undone win is retracted, not erased
+      if (!drawn.empty()) registry.record(drawn, redo ? REG_WIN : REG_RETRACT);
 
-  for (int i = 0; i < 32; i++) {
-    rlutil::locate(8, y);
-    rlutil::setColor(rlutil::LIGHTCYAN);
-    cout << ">>> ";
-    rlutil::setColor(rlutil::WHITE);
-    cout << dist(rng) << "                           " << flush;
-    rlutil::msleep(35 + (i / 12) * 10);
+      ui_header(redo ? "已重做" : "已復原", what);
+      rlutil::setColor(rlutil::LIGHTGREEN);
+      cout << "全部 " << all.size() << " 人 / 可抽 " << pool.size() << " 人 / 已抽 " << history.size() << " 人\n";
+      rlutil::setColor(rlutil::GREY);
+      pause_anykey();
+    }
+    else {
+      rlutil::setColor(rlutil::LIGHTRED);
+      cout << "\n無效選項。\n";
+      rlutil::setColor(rlutil::GREY);
+      pause_anykey();
+    }
   }
-
-  return dist(rng);
 }
 
-// ---------------------- Mode A: List draw ----------------------
-static void mode_list_draw(mt19937& rng) {
-  vector<string> all;
-  vector<string> pool;
-  vector<string> history;
+// ---------------------- Mode B: Range draw ----------------------
+static void mode_range_draw(Session& s, Journal& journal) {
+  RangeState& st = s.range;
+  mt19937& rng = s.rng;
+  const int& N = st.N;
+  const bool& noRepeat = st.noRepeat;
+  const IntStore& pool = st.pool;
+  const IntStore& history = st.history;
+  CooldownSampler cool;
 
   while (true) {
-    ui_header("模式 A：名單抽籤（不重複）", "可手動輸入 / 讀檔；抽到會從池子移除");
+    ui_header("模式 B：範圍抽籤（1 ~ N）", "可選是否不重複抽；有重置與狀態顯示");
     ui_status_bar(
-      "狀態：全部 " + to_string(all.size()) + " 人 / 可抽 " + to_string(pool.size()) + " 人 / 已抽 " + to_string(history.size()) + " 人",
-      "A 模式"
+      "狀態：N=" + to_string(N) +
+      " / 不重複=" + string(noRepeat ? "是" : st.cooldown ? "否（冷卻 " + to_string(st.cooldown) + " 次）" : "否") +
+      " / 可抽=" + (noRepeat ? to_string((int)pool.size()) : string("-")) +
+      " / 已抽=" + to_string((int)history.size()),
+      pool.mapped() ? "B 模式（mmap）" : "B 模式"
     );
 
     ui_menu({
-      "1) 手動輸入名單（逐行輸入，空行結束）",
-      "2) 從檔案載入名單（每行一個名字）",
-      "3) 抽一位（不重複）",
-      "4) 查看名單（全部 / 剩餘 / 已抽）",
-      "5) 重置抽籤（已抽回池子）",
-      "6) 匯出已抽結果（CSV）",
+      "1) 設定 N",
+      "2) 切換不重複（目前：" + string(noRepeat ? "是" : "否") + "）",
+      "3) 抽一次",
+      "4) 查看已抽記錄",
+      "5) 重置（清空已抽/重建池子）",
+      "6) 匯出已抽記錄（CSV / JSON Lines / 二進位）",
+      "7) 復原上一步（" + to_string(st.undo.size()) + "）",
+      "8) 重做（" + to_string(st.redo.size()) + "）",
+      "9) 時光回溯：第 k 次抽籤前的池子",
+      "10) 查詢號碼是否抽中",
+      "11) 冷卻視窗：可重複時，最近 W 次抽過的不再抽出（目前：" + (st.cooldown ? to_string(st.cooldown) : string("關")) + "）",
+      "12) 大量產生彩券（N 選 k，寫入檔案）",
+      "13) 以排名抽出 k 個號碼（公開一個可驗證的排名" + string(!noRepeat && st.cooldown ? "；不套用冷卻視窗" : "") + "）",
+      "14) 驗證排名（N、k、排名 → 號碼）",
       "0) 返回主選單"
     });
 
     int op;
     cin >> op;
-
     if (op == 0) return;
 
     if (op == 1) {
-      ui_header("手動輸入名單", "一行一個名字；輸入空行結束");
-      clear_input_line();
+      ui_header("設定 N", "例如 50 代表抽 1~50");
+      cout << "請輸入 N： " << flush;
+      int n = 0;
+      cin >> n;
+      range_set_n(st, n);
+      journal.log_range_set_n(st.N);
+      journal.commit();
+      if (N <= 0) {
+        rlutil::setColor(rlutil::LIGHTRED);
+        cout << "\nN 必須 > 0\n";
+        rlutil::setColor(rlutil::GREY);
+        pause_anykey();
+        continue;
+      }
+      rlutil::setColor(rlutil::LIGHTGREEN);
+      cout << "\n✅ 已設定 N=" << N << "\n";
+      rlutil::setColor(rlutil::GREY);
+      pause_anykey();
+    }
+    else if (op == 2) {
+      range_set_norepeat(st, !noRepeat);
+      journal.log_range_norepeat(noRepeat);
+      journal.commit();
+      pause_anykey(string("已切換不重複為：") + (noRepeat ? "是" : "否"));
+    }
+    else if (op == 3) {
+      if (N <= 0) {
+        ui_header("抽一次", "請先設定 N");
+        rlutil::setColor(rlutil::LIGHTRED);
+        cout << "⚠️ 你還沒設定 N。\n";
+        rlutil::setColor(rlutil::GREY);
+        pause_anykey();
+        continue;
+      }
 
-      string line;
-      int added = 0;
-      while (true) {
-        rlutil::setColor(rlutil::LIGHTCYAN);
-        cout << "> " << flush;
+      if (noRepeat) {
+        if (pool.empty()) {
+          ui_header("抽一次", "池子已空，請重置或關閉不重複");
+          rlutil::setColor(rlutil::LIGHTRED);
+          cout << "⚠️ 沒有號碼可抽。\n";
+          rlutil::setColor(rlutil::GREY);
+          pause_anykey();
+          continue;
+        }
+
+        // show animation using N, but final pick must come from pool
+        // We'll animate numbers, then pick from pool uniformly:
+        animated_pick_number(N, rng, "抽籤中（號碼）");
+        uniform_int_distribution<int> dist(0, (int)pool.size() - 1);
+        int idx = dist(rng);
+        int result = pool[idx];
+        uint64_t ts = now_unix_ms();
+        range_apply_draw(st, idx, result, ts);
+        journal.log_range_draw(idx, result, ts);
+        journal.commit();
+
+        ui_header("抽籤結果", "恭喜中籤！");
+        rlutil::setColor(rlutil::LIGHTGREEN);
+        cout << "\n🎉 中籤號碼：";
+        rlutil::setColor(rlutil::YELLOW);
+        cout << result << "\n";
         rlutil::setColor(rlutil::GREY);
+        cout << "剩餘可抽： " << pool.size() << "\n";
 
-        getline(cin, line);
-        line = trim(line);
-        if (line.empty()) break;
+        pause_anykey();
+      } else {
+        int result = animated_pick_number(N, rng, "抽籤中（號碼）");
+        if (st.cooldown && N > 1) result = cool.draw(st, st.cooldown, rng);
+        uint64_t ts = now_unix_ms();
+        range_apply_draw(st, 0, result, ts);
+        cool.push(st, result);
+        journal.log_range_draw(0, result, ts);
+        journal.commit();
 
-        all.push_back(line);
-        pool.push_back(line);
-        added++;
+        ui_header("抽籤結果", st.cooldown && N > 1
+          ? "（最近 " + to_string(min(st.cooldown, (size_t)N - 1)) + " 次抽過的不會出現）"
+          : string("（此模式允許重複）"));
+        rlutil::setColor(rlutil::LIGHTGREEN);
+        cout << "\n🎉 中籤號碼：";
+        rlutil::setColor(rlutil::YELLOW);
+        cout << result << "\n";
+        rlutil::setColor(rlutil::GREY);
+        pause_anykey();
+      }
+    }
+    else if (op == 4) {
+      ui_header("已抽記錄（號碼）", "由小到大顯示（不改變抽籤順序）");
+      if (history.empty()) {
+        rlutil::setColor(rlutil::DARKGREY);
+        cout << "（尚未抽出）\n";
+        rlutil::setColor(rlutil::GREY);
+      } else {
+        vector<int> tmp(history.begin(), history.end());
+        sort(tmp.begin(), tmp.end());
+        rlutil::setColor(rlutil::WHITE);
+        for (size_t i = 0; i < tmp.size(); i++) cout << tmp[i] << (i + 1 == tmp.size() ? "\n" : ", ");
+        rlutil::setColor(rlutil::GREY);
+      }
+      pause_anykey();
+    }
+    else if (op == 5) {
+      range_reset(st);
+      journal.log_range_reset();
+      journal.commit();
+      ui_header("已重置", "已清空已抽並重建池子");
+      rlutil::setColor(rlutil::LIGHTGREEN);
+      cout << "N=" << N << " / 可抽=" << (noRepeat ? to_string((int)pool.size()) : string("-")) << "\n";
+      rlutil::setColor(rlutil::GREY);
+      pause_anykey();
+    }
+    else if (op == 6) {
+      ui_export_history(history.size(), st.exported,
+        [&](ExportFormat fmt, const string& out, size_t from, bool append, JobProgress& p) {
+          return export_range_history(st, s.seed, fmt, out, from, append, &p);
+        });
+    }
+    else if (op == 7 || op == 8) {
+      bool redo = op == 8;
+      vector<RangeOp>& log = redo ? st.redo : st.undo;
+      if (log.empty()) {
+        pause_anykey(redo ? "沒有可重做的步驟，按任意鍵返回..." : "沒有可復原的步驟，按任意鍵返回...");
+        continue;
       }
+      const RangeOp& last = log.back();
+      string what;
+      if (last.kind == RangeOp::DRAW) what = "抽出 " + to_string(last.value);
+      else if (last.kind == RangeOp::REPEAT_ON) what = "關閉不重複";
+      else what = "設定 / 重置";
 
-      dedup_preserve_order(all);
-      dedup_preserve_order(pool);
+      if (redo) range_redo(st);
+      else range_undo(st);
+      journal.log_range_undo(redo);
+      journal.commit();
 
+      ui_header(redo ? "已重做" : "已復原", what);
       rlutil::setColor(rlutil::LIGHTGREEN);
-      cout << "\n新增 " << added << " 筆；目前可抽 " << pool.size() << " 人。\n";
+      cout << "N=" << N << " / 不重複=" << (noRepeat ? "是" : "否")
+           << " / 可抽=" << (noRepeat ? to_string((int)pool.size()) : string("-"))
+           << " / 已抽=" << history.size() << "\n";
       rlutil::setColor(rlutil::GREY);
       pause_anykey();
     }
-    else if (op == 2) {
-      ui_header("從檔案載入名單", "每行一個名字，例如 names.txt / classA.txt");
-      cout << "請輸入檔名/路徑： " << flush;
-
-      string filename;
-      cin >> filename;
+    else if (op == 11) {
+      ui_header("冷卻視窗", "不重複關閉時使用；例如 W=3 代表最近 3 次抽過的號碼暫時不會再出現");
+      cout << "請輸入 W（0 = 關閉，最多 N-1）： " << flush;
+      long long w = -1;
+      cin >> w;
+      if (w < 0) { pause_anykey("W 必須 >= 0，按任意鍵返回..."); continue; }
+      st.cooldown = (size_t)w;
+      if (N > 0 && st.cooldown >= (size_t)N) st.cooldown = N - 1;
+      string msg = st.cooldown ? "已設定冷卻視窗：" + to_string(st.cooldown) + " 次" : string("已關閉冷卻視窗");
+      if (noRepeat && st.cooldown) msg += "（目前為不重複模式，關閉不重複後生效）";
+      pause_anykey(msg);
+    }
+    else if (op == 12) {
+      ui_header("大量產生彩券", "每張 k 個不重複號碼（1 ~ N），由小到大寫入檔案，一行一張");
+      TicketSpec sp;
+      cout << "每張幾個號碼 k： " << flush;
+      cin >> sp.k;
+      cout << "號碼範圍 N（例如 49 代表 1 ~ 49）： " << flush;
+      cin >> sp.n;
+      if (sp.n < 1 || sp.k < 1 || sp.k > sp.n) { pause_anykey("需要 1 <= k <= N，按任意鍵返回..."); continue; }
+      cout << "產生幾張： " << flush;
+      long long count = 0;
+      cin >> count;
+      if (count < 1) { pause_anykey("張數必須 >= 1，按任意鍵返回..."); continue; }
+      sp.count = (uint64_t)count;
+      cout << "輸出檔名（例如 tickets.txt）： " << flush;
+      string out;
+      cin >> out;
+      sp.seed = rng();
 
-      ifstream fin(filename);
-      if (!fin) {
+      auto t0 = chrono::steady_clock::now();
+      bool cancelled = false;
+      bool ok = run_with_progress("產生中", [&](JobProgress& p) {
+        return write_tickets(sp, out, thread::hardware_concurrency(), &p);
+      }, cancelled);
+      double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+      if (ok) {
+        rlutil::setColor(rlutil::LIGHTGREEN);
+        cout << "\n✅ 已產生 " << sp.count << " 張（" << sp.k << " / " << sp.n << "）到 " << out
+             << "（" << (uint64_t)ms << " ms）\n";
+        rlutil::setColor(rlutil::GREY);
+        cout << "種子：" << sp.seed << "（同種子、同參數可重現同一批）\n";
+      } else {
         rlutil::setColor(rlutil::LIGHTRED);
-        cout << "\n❌ 無法開啟檔案：" << filename << "\n";
+        cout << (cancelled ? "\n已取消，檔案不完整：" : "\n❌ 無法寫入：") << out << "\n";
         rlutil::setColor(rlutil::GREY);
-        pause_anykey();
+      }
+      pause_anykey();
+    }
+    else if (op == 13 || op == 14) {
+      bool verify = op == 14;
+      ui_header(verify ? "驗證排名" : "以排名抽出 k 個號碼",
+                verify ? "輸入公開的 N、k 與排名，重新算出號碼" : "從 C(N,k) 種組合中均勻抽一個排名，再換算成號碼");
+      int n = N, k = 0;
+      if (verify) {
+        cout << "N： " << flush;
+        cin >> n;
+      } else if (N <= 0) {
+        pause_anykey("⚠️ 你還沒設定 N，按任意鍵返回...");
+        continue;
+      } else if (noRepeat && pool.size() != (size_t)N) {
+        pause_anykey("⚠️ 不重複模式下需要完整的 1 ~ N 池子，請先重置。按任意鍵返回...");
         continue;
       }
+      cout << "k（1 ~ " << max(n, 1) << "）： " << flush;
+      cin >> k;
+      if (n < 1 || k < 1 || k > n) { pause_anykey("需要 1 <= k <= N，按任意鍵返回..."); continue; }
 
-      string line;
-      int added = 0;
-      while (getline(fin, line)) {
-        line = trim(line);
-        if (line.empty()) continue;
-        all.push_back(line);
-        pool.push_back(line);
-        added++;
+      BigUint total = binomial(n, k), rank;
+      if (verify) {
+        cout << "排名（0 ~ C(N,k)-1）： " << flush;
+        string s;
+        cin >> s;
+        if (!BigUint::parse(s, rank) || !(rank < total)) { pause_anykey("排名無效，按任意鍵返回..."); continue; }
+      } else {
+        animated_pick_number(N, rng, "抽籤中（組合）");
+        rank = random_below(total, rng);
       }
+      vector<int> nums = unrank_subset(rank, n, k);
+      if (!verify) range_draw_subset(st, journal, nums);
 
-      dedup_preserve_order(all);
-      dedup_preserve_order(pool);
-
+      ui_header(verify ? "驗證結果" : "抽籤結果", "N=" + to_string(n) + "，k=" + to_string(k));
       rlutil::setColor(rlutil::LIGHTGREEN);
-      cout << "\n已載入 " << added << " 筆；目前可抽 " << pool.size() << " 人。\n";
+      cout << "\n" << (verify ? "號碼：" : "🎉 中籤號碼：");
+      rlutil::setColor(rlutil::YELLOW);
+      const size_t SHOW = 500;
+      for (size_t i = 0; i < nums.size() && i < SHOW; i++) cout << nums[i] << (i + 1 == nums.size() ? "\n" : ", ");
+      if (nums.size() > SHOW) cout << "...（共 " << nums.size() << " 個，完整記錄請用匯出）\n";
+      rlutil::setColor(rlutil::WHITE);
+      cout << "排名：" << rank.str() << "\n";
       rlutil::setColor(rlutil::GREY);
+      cout << "組合總數 C(" << n << "," << k << ")：" << (total.bits() > 256 ? "約 2^" + to_string(total.bits() - 1) : total.str()) << "\n";
+      if (!verify) cout << "公開 N、k 與排名，任何人都可用「驗證排名」算出同一組號碼。\n";
+      if (!verify && !noRepeat && st.cooldown)
+        cout << "（排名涵蓋全部 1 ~ N，冷卻視窗不套用在這次抽籤）\n";
       pause_anykey();
     }
-    else if (op == 3) {
-      if (pool.empty()) {
-        ui_header("抽一位", "池子已空，請先輸入名單或重置");
-        rlutil::setColor(rlutil::LIGHTRED);
-        cout << "⚠️ 沒有人可以抽。\n";
+    else if (op == 10) {
+      ui_header("查詢號碼", "輸入號碼查詢第幾次抽中；輸入空行結束");
+      clear_input_line();
+      string line;
+      while (true) {
+        rlutil::setColor(rlutil::LIGHTCYAN);
+        cout << "> " << flush;
+        rlutil::setColor(rlutil::GREY);
+        if (!getline(cin, line)) break;
+        line = trim(line);
+        if (line.empty()) break;
+
+        int v = 0;
+        auto res = from_chars(line.data(), line.data() + line.size(), v);
+        if (res.ec != errc() || res.ptr != line.data() + line.size()) {
+          rlutil::setColor(rlutil::LIGHTRED);
+          cout << "  請輸入整數\n";
+          rlutil::setColor(rlutil::GREY);
+          continue;
+        }
+        vector<size_t> at = range_positions(st, v);
+        if (at.empty()) {
+          rlutil::setColor(rlutil::DARKGREY);
+          cout << "  " << v << "：未抽中\n";
+        } else {
+          const size_t SHOW = 20;
+          rlutil::setColor(rlutil::LIGHTGREEN);
+          cout << "  🎉 " << v << "：第 ";
+          for (size_t i = 0; i < at.size() && i < SHOW; i++) cout << (i ? "、" : "") << (at[i] + 1);
+          if (at.size() > SHOW) cout << "…";
+          cout << " 次抽中（共 " << at.size() << " 次）\n";
+        }
+        rlutil::setColor(rlutil::GREY);
+      }
+    }
+    else if (op == 9) {
+      ui_header("時光回溯", "第 k 次抽籤前，池子裡還有哪些號碼");
+      if (history.empty()) {
+        rlutil::setColor(rlutil::DARKGREY);
+        cout << "（尚未抽出）\n";
         rlutil::setColor(rlutil::GREY);
         pause_anykey();
         continue;
       }
+      cout << "第幾次抽籤前（1 ~ " << history.size() << "）： " << flush;
+      size_t k = 0; cin >> k;
+      if (k < 1 || k > history.size()) continue;
 
-      int idx = animated_pick_index(pool, rng, "抽籤中（名單）");
-      string winner = pool[idx];
+      PoolAt<int> at = range_pool_at(st, k);
+      rlutil::setColor(rlutil::LIGHTGREEN);
+      cout << "\n第 " << k << " 次抽籤前池子共 " << at.count << " 個號碼（該次抽出：" << history[k - 1] << "）\n";
+      if (!at.exact) {
+        rlutil::setColor(rlutil::DARKGREY);
+        cout << "（此次抽籤早於保存的操作紀錄，結果可能不完整）\n";
+      }
+      const size_t SHOW = 2000;
+      vector<int> v;
+      at.for_each(pool, [&](int x) { if (v.size() < SHOW) v.push_back(x); });
+      sort(v.begin(), v.end());
+      rlutil::setColor(rlutil::WHITE);
+      for (size_t i = 0; i < v.size(); i++) cout << v[i] << (i + 1 == v.size() ? "\n" : ", ");
+      if (at.count > v.size()) cout << "...（僅顯示前 " << v.size() << " 個）\n";
+      rlutil::setColor(rlutil::GREY);
+      pause_anykey();
+    }
+    else {
+      rlutil::setColor(rlutil::LIGHTRED);
+      cout << "\n無效選項。\n";
+      rlutil::setColor(rlutil::GREY);
+      pause_anykey();
+    }
+  }
+}
+
+// ---------------------- Mode C: Shared pool ----------------------
+static void mode_shared_draw(Session& s, const string& shmName) {
+  SharedPool sp;
+  list_ready(s);
+
+  while (true) {
+    bool on = sp.open(shmName);
+    ui_header("模式 C：共享池（多台終端同時抽）", "同一台電腦上的多個 draw 共用一個池子，不會重複");
+    ui_status_bar(
+      on ? "狀態：" + string(sp.kind() == SharedPool::NAMES ? "名單" : "號碼") + " / 共 " + to_string(sp.size()) +
+           " / 已抽 " + to_string(sp.claimed()) + " / 可抽 " + to_string(sp.size() - sp.claimed())
+         : string("狀態：尚未建立共享池"),
+      "C 模式（" + shmName + "）"
+    );
+
+    ui_menu({
+      "1) 發布模式 A 的剩餘名單為共享池（" + to_string(s.list.pool.size()) + " 人）",
+      "2) 發布 1 ~ N 號碼為共享池",
+      "3) 抽一位",
+      "4) 查看已抽（所有終端）",
+      "5) 移除共享池",
+      "0) 返回主選單"
+    });
 
-      pool.erase(pool.begin() + idx);
-      history.push_back(winner);
+    int op;
+    cin >> op;
+    if (op == 0) return;
 
-      ui_header("抽籤結果", "恭喜中籤！");
+    if (op == 1 || op == 2) {
+      bool ok;
+      if (op == 1) {
+        ok = !s.list.pool.empty() && sp.publish_names(shmName, s.list.pool, s.rng);
+      } else {
+        cout << "請輸入 N（>=1）： " << flush;
+        int N = 0; cin >> N;
+        ok = N >= 1 && sp.publish_numbers(shmName, N, s.rng);
+      }
+      if (ok) pause_anykey("已發布，其他終端下次抽籤即使用新池子。按任意鍵繼續...");
+      else pause_anykey("無法建立共享池（池子為空或系統不支援），按任意鍵返回...");
+    }
+    else if (op == 3) {
+      uint64_t t;
+      if (!on || !sp.claim(t)) {
+        pause_anykey(on ? "共享池已抽完，按任意鍵返回..." : "尚未建立共享池，按任意鍵返回...");
+        continue;
+      }
+      ui_header("抽籤結果", "第 " + to_string(t + 1) + " 位（共享池）");
       rlutil::setColor(rlutil::LIGHTGREEN);
       cout << "\n🎉 中籤：";
       rlutil::setColor(rlutil::YELLOW);
-      cout << winner << "\n";
+      cout << sp.entry(t) << "\n";
       rlutil::setColor(rlutil::GREY);
-      cout << "剩餘可抽： " << pool.size() << " 人\n";
-
+      cout << "剩餘可抽： " << (sp.size() - sp.claimed()) << "\n";
       pause_anykey();
     }
     else if (op == 4) {
-      ui_header("查看名單", "可查看：全部 / 剩餘 / 已抽");
-      ui_menu({
-        "1) 全部名單",
-        "2) 剩餘可抽",
-        "3) 已抽記錄",
-        "0) 返回"
-      }, "選項");
-
-      int t; cin >> t;
-      if (t == 0) continue;
-
-      auto print_list = [&](const vector<string>& v, const string& emptyMsg) {
+      ui_header("已抽（所有終端）", "依抽出順序");
+      uint64_t n = on ? sp.claimed() : 0;
+      if (n == 0) {
+        rlutil::setColor(rlutil::DARKGREY);
+        cout << "（尚未抽出）\n";
+      }
+      const uint64_t SHOW = 500;
+      rlutil::setColor(rlutil::WHITE);
+      for (uint64_t i = 0; i < n && i < SHOW; i++) {
+        cout << (i + 1) << ". " << sp.entry(i);
+        if (int32_t pid = sp.claimed_by(i)) cout << "（終端 " << pid << "）";
         cout << "\n";
-        if (v.empty()) {
-          rlutil::setColor(rlutil::DARKGREY);
-          cout << emptyMsg << "\n";
-          rlutil::setColor(rlutil::GREY);
-          return;
-        }
-        rlutil::setColor(rlutil::WHITE);
-        for (size_t i = 0; i < v.size(); i++) cout << (i + 1) << ". " << v[i] << "\n";
-        rlutil::setColor(rlutil::GREY);
-      };
-
-      if (t == 1) print_list(all, "（目前沒有任何名單）");
-      else if (t == 2) print_list(pool, "（池子已空）");
-      else if (t == 3) print_list(history, "（尚未抽出任何人）");
-
+      }
+      if (n > SHOW) cout << "...（共 " << n << " 位）\n";
+      rlutil::setColor(rlutil::GREY);
       pause_anykey();
     }
     else if (op == 5) {
-      pool = all;
-      history.clear();
-      ui_header("重置完成", "已將已抽回池子");
-      rlutil::setColor(rlutil::LIGHTGREEN);
-      cout << "可抽：" << pool.size() << " 人\n";
-      rlutil::setColor(rlutil::GREY);
-      pause_anykey();
+      sp.close();
+      SharedPool::unlink(shmName);
+      pause_anykey("已移除共享池，按任意鍵繼續...");
     }
-    else if (op == 6) {
-      ui_header("匯出已抽結果", "輸出 CSV：序號,名字");
-      cout << "輸出檔名（例如 result.csv）： " << flush;
-      string out;
-      cin >> out;
-      save_history_to_file(history, out);
+    else {
+      pause_anykey("無效選項，按任意鍵返回...");
+    }
+  }
+}
 
-      rlutil::setColor(rlutil::LIGHTGREEN);
-      cout << "\n✅ 已輸出（若 history 為空則為空檔）： " << out << "\n";
-      rlutil::setColor(rlutil::GREY);
-      pause_anykey();
+// ---------------------- Mode D: Team grouping ----------------------
+static void ui_partition_pages(const vector<string>& names, const Partition& p) {
+  const size_t PAGE = 40;
+  size_t team = 0, page = 0;
+  while (true) {
+    const vector<uint32_t>& m = p.members[team];
+    size_t pages = max<size_t>(1, (m.size() + PAGE - 1) / PAGE);
+    if (page >= pages) page = pages - 1;
+    ui_header("分組結果", "第 " + to_string(team + 1) + " / " + to_string(p.k) + " 組（" + to_string(m.size()) +
+                          " 人），第 " + to_string(page + 1) + " / " + to_string(pages) + " 頁");
+    rlutil::setColor(rlutil::WHITE);
+    for (size_t i = page * PAGE; i < m.size() && i < (page + 1) * PAGE; i++)
+      cout << (i + 1) << ". " << names[m[i]] << "\n";
+    if (m.empty()) {
+      rlutil::setColor(rlutil::DARKGREY);
+      cout << "（此組沒有成員）\n";
+    }
+    rlutil::setColor(rlutil::GREY);
+    cout << "\nn 下一頁  p 上一頁  ] 下一組  [ 上一組  數字 跳到第幾組  0 返回： " << flush;
+    string cmd;
+    if (!(cin >> cmd) || cmd == "0") return;
+    if (cmd == "n") {
+      if (page + 1 < pages) page++;
+      else if (team + 1 < p.k) { team++; page = 0; }
+    }
+    else if (cmd == "p") {
+      if (page > 0) page--;
+      else if (team > 0) { team--; page = SIZE_MAX; }
     }
+    else if (cmd == "]") { if (team + 1 < p.k) { team++; page = 0; } }
+    else if (cmd == "[") { if (team > 0) { team--; page = 0; } }
     else {
-      rlutil::setColor(rlutil::LIGHTRED);
-      cout << "\n無效選項。\n";
-      rlutil::setColor(rlutil::GREY);
-      pause_anykey();
+      size_t t = 0;
+      auto res = from_chars(cmd.data(), cmd.data() + cmd.size(), t);
+      if (res.ec == errc() && t >= 1 && t <= p.k) { team = t - 1; page = 0; }
     }
   }
 }
 
-// ---------------------- Mode B: Range draw ----------------------
-static void mode_range_draw(mt19937& rng) {
-  int N = 0;
-  bool noRepeat = true;
-  vector<int> pool;     // for no-repeat
-  vector<int> history;  // drawn numbers
-
-  auto reset_pool = [&]() {
-    pool.clear();
-    history.clear();
-    if (N <= 0) return;
-    pool.reserve(N);
-    for (int i = 1; i <= N; i++) pool.push_back(i);
-  };
+static void mode_group_draw(Session& s) {
+  Partition part;
+  list_ready(s);
 
   while (true) {
-    ui_header("模式 B：範圍抽籤（1 ~ N）", "可選是否不重複抽；有重置與狀態顯示");
+    const vector<string>& names = s.list.all;
+    if (part.teamOf.size() != names.size()) part = Partition();  // roster changed since grouping
+    ui_header("模式 D：隨機分組", "把模式 A 的完整名單平均分成 K 組（名單可用「姓名,部門」帶分組欄位）");
     ui_status_bar(
-      "狀態：N=" + to_string(N) +
-      " / 不重複=" + string(noRepeat ? "是" : "否") +
-      " / 可抽=" + (noRepeat ? to_string((int)pool.size()) : string("-")) +
-      " / 已抽=" + to_string((int)history.size()),
-      "B 模式"
+      "名單：" + to_string(names.size()) + " 人 / " +
+        (part.k ? "已分 " + to_string(part.k) + " 組" + (part.stratified ? "（依部門分層）" : "") : string("尚未分組")),
+      "D 模式"
     );
 
     ui_menu({
-      "1) 設定 N",
-      "2) 切換不重複（目前：" + string(noRepeat ? "是" : "否") + "）",
-      "3) 抽一次",
-      "4) 查看已抽記錄",
-      "5) 重置（清空已抽/重建池子）",
+      "1) 隨機分組",
+      "2) 依部門分層分組（各部門平均分散到各組）",
+      "3) 查看分組（分頁）",
+      "4) 匯出分組 CSV（組別,姓名）",
+      "5) 依限制檔分組（指定兩人不同組、每組同部門上限）",
       "0) 返回主選單"
     });
 
@@ -414,129 +4947,824 @@ static void mode_range_draw(mt19937& rng) {
     cin >> op;
     if (op == 0) return;
 
-    if (op == 1) {
-      ui_header("設定 N", "例如 50 代表抽 1~50");
-      cout << "請輸入 N： " << flush;
-      cin >> N;
-      if (N <= 0) {
-        rlutil::setColor(rlutil::LIGHTRED);
-        cout << "\nN 必須 > 0\n";
-        rlutil::setColor(rlutil::GREY);
-        pause_anykey();
-        N = 0;
-        pool.clear();
-        history.clear();
-        continue;
-      }
-      reset_pool();
+    if (op == 1 || op == 2) {
+      if (names.empty()) { pause_anykey("模式 A 名單是空的，請先輸入或讀檔。按任意鍵返回..."); continue; }
+      cout << "請輸入組數 K（1 ~ " << names.size() << "）： " << flush;
+      size_t k = 0;
+      cin >> k;
+      if (k < 1 || k > names.size()) { pause_anykey("組數無效，按任意鍵返回..."); continue; }
+      auto t0 = chrono::steady_clock::now();
+      part = partition_roster(names, k, op == 2, s.rng);
+      double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+      size_t lo = names.size() / k;
       rlutil::setColor(rlutil::LIGHTGREEN);
-      cout << "\n✅ 已設定 N=" << N << "\n";
+      cout << "\n✅ 已分成 " << k << " 組，每組 " << lo << (names.size() % k ? " ~ " + to_string(lo + 1) : string())
+           << " 人（" << (uint64_t)ms << " ms）\n";
       rlutil::setColor(rlutil::GREY);
       pause_anykey();
     }
-    else if (op == 2) {
-      noRepeat = !noRepeat;
-      if (noRepeat) reset_pool();
-      pause_anykey(string("已切換不重複為：") + (noRepeat ? "是" : "否"));
-    }
     else if (op == 3) {
-      if (N <= 0) {
-        ui_header("抽一次", "請先設定 N");
-        rlutil::setColor(rlutil::LIGHTRED);
-        cout << "⚠️ 你還沒設定 N。\n";
-        rlutil::setColor(rlutil::GREY);
-        pause_anykey();
+      if (!part.k) { pause_anykey("尚未分組，按任意鍵返回..."); continue; }
+      ui_partition_pages(names, part);
+    }
+    else if (op == 4) {
+      if (!part.k) { pause_anykey("尚未分組，按任意鍵返回..."); continue; }
+      cout << "請輸入檔名（例如 teams.csv）： " << flush;
+      string path;
+      cin >> path;
+      if (write_partition(path, names, part)) pause_anykey("已匯出：" + path + "，按任意鍵繼續...");
+      else pause_anykey("寫入失敗：" + path + "，按任意鍵返回...");
+    }
+    else if (op == 5) {
+      if (names.empty()) { pause_anykey("模式 A 名單是空的，請先輸入或讀檔。按任意鍵返回..."); continue; }
+      cout << "請輸入限制檔路徑（例如 rules.txt）： " << flush;
+      string path, err;
+      cin >> path;
+      GroupConstraints gc;
+      if (!load_group_constraints(path, gc, err)) { pause_anykey(err + "，按任意鍵返回..."); continue; }
+      cout << "請輸入組數 K（1 ~ " << names.size() << "）： " << flush;
+      size_t k = 0;
+      cin >> k;
+      if (k < 1 || k > names.size()) { pause_anykey("組數無效，按任意鍵返回..."); continue; }
+      auto t0 = chrono::steady_clock::now();
+      ConstraintReport rep;
+      part = partition_constrained(names, k, gc, s.rng, rep);
+      double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+      bool ok = rep.conflicts == 0 && rep.overCap == 0;
+      rlutil::setColor(ok ? rlutil::LIGHTGREEN : rlutil::YELLOW);
+      cout << "\n" << (ok ? "✅ 已分成 " : "⚠️ 已分成 ") << k << " 組，限制 " << gc.apart.size() << " 組"
+           << (gc.maxPerTeam ? "、每組同部門最多 " + to_string(gc.maxPerTeam) + " 人" : string())
+           << "，調整 " << rep.swaps << " 次（" << (uint64_t)ms << " ms）\n";
+      if (!ok) cout << "仍有 " << rep.conflicts << " 組同組、" << rep.overCap << " 人超過部門上限（限制可能無法同時滿足）\n";
+      if (rep.unknown) cout << "限制檔中有 " << rep.unknown << " 組的姓名不在名單內，已略過\n";
+      rlutil::setColor(rlutil::GREY);
+      pause_anykey();
+    }
+    else {
+      pause_anykey("無效選項，按任意鍵返回...");
+    }
+  }
+}
+
+// ---------------------- Draw service (Unix socket) ----------------------
+// `draw --serve PATH` runs the mode A / mode B engines as a local daemon.
+// Each connection picks a named session (created on first use, shared by
+// every client that names it) and sends one request per line; every request
+// gets exactly one reply line, so clients may pipeline. Names in ADD are
+// tab-separated.
+//   USE name        -> OK                   select / create a session
+//   ADD a\tb\t...   -> OK added pool
+//   DRAW            -> OK winner | ERR empty
+//   WON name        -> OK position (0 = not drawn)
+//   RESET / UNDO / REDO
+//   RANGE N         -> OK                   mode B: set N (rebuilds pool)
+//   NOREPEAT 0|1    -> OK
+//   RDRAW           -> OK number | ERR empty
+//   RRESET / RUNDO / RREDO
+//   STAT            -> OK all pool drawn N rpool rdrawn
+// One epoll reactor thread serves every client; sessions live in memory for
+// the life of the daemon. Linux only.
+#ifdef __linux__
+static volatile sig_atomic_t g_serveStop = 0;
+static void serve_on_signal(int) { g_serveStop = 1; }
+
+struct ServeConn {
+  int fd = -1;
+  string in, out;
+  Session* session = nullptr;
+};
+
+struct ServeState {
+  unordered_map<string, unique_ptr<Session>> sessions;
+  uint32_t nextSeed = (uint32_t)time(nullptr);
+};
+
+static string serve_request(ServeState& sv, ServeConn& c, string_view line) {
+  size_t sp = line.find(' ');
+  string_view cmd = line.substr(0, sp);
+  string arg = sp == string_view::npos ? string() : string(line.substr(sp + 1));
+
+  if (cmd == "USE") {
+    if (arg.empty()) return "ERR name";
+    unique_ptr<Session>& s = sv.sessions[arg];
+    if (!s) {
+      s.reset(new Session());
+      s->seed = sv.nextSeed++;
+      s->rng.seed(s->seed);
+    }
+    c.session = s.get();
+    return "OK";
+  }
+  if (cmd == "PING") return "OK";
+  if (!c.session) return "ERR no session (USE name)";
+  Session& s = *c.session;
+  ListState& ls = s.list;
+  RangeState& rs = s.range;
+
+  if (cmd == "ADD") {
+    vector<string> names;
+    size_t p = 0;
+    while (p <= arg.size()) {
+      size_t q = arg.find('\t', p);
+      if (q == string::npos) q = arg.size();
+      string n = trim(arg.substr(p, q - p));
+      if (!n.empty()) names.push_back(move(n));
+      p = q + 1;
+    }
+    size_t before = ls.pool.size();
+    list_add_names(ls, names);
+    return "OK " + to_string(ls.pool.size() - before) + " " + to_string(ls.pool.size());
+  }
+  if (cmd == "DRAW") {
+    if (ls.pool.empty()) return "ERR empty";
+    size_t idx = uniform_int_distribution<size_t>(0, ls.pool.size() - 1)(s.rng);
+    return "OK " + list_apply_draw(ls, idx, now_unix_ms());
+  }
+  if (cmd == "WON") {
+    auto it = ls.drawnPos.find(arg);
+    return "OK " + to_string(it == ls.drawnPos.end() ? 0 : it->second + 1);
+  }
+  if (cmd == "RESET") { list_reset(ls); return "OK"; }
+  if (cmd == "UNDO") return list_undo(ls) ? "OK" : "ERR nothing";
+  if (cmd == "REDO") return list_redo(ls) ? "OK" : "ERR nothing";
+  if (cmd == "RANGE") {
+    int n = 0;
+    auto r = from_chars(arg.data(), arg.data() + arg.size(), n);
+    if (r.ec != errc() || n < 1) return "ERR N";
+    range_set_n(rs, n);
+    return "OK";
+  }
+  if (cmd == "NOREPEAT") {
+    if (arg != "0" && arg != "1") return "ERR 0|1";
+    if ((arg == "1") != rs.noRepeat) range_set_norepeat(rs, arg == "1");
+    return "OK";
+  }
+  if (cmd == "RDRAW") {
+    if (rs.N <= 0) return "ERR N";
+    uint64_t ts = now_unix_ms();
+    if (!rs.noRepeat) {
+      int v = uniform_int_distribution<int>(1, rs.N)(s.rng);
+      range_apply_draw(rs, 0, v, ts);
+      return "OK " + to_string(v);
+    }
+    if (rs.pool.empty()) return "ERR empty";
+    size_t idx = uniform_int_distribution<size_t>(0, rs.pool.size() - 1)(s.rng);
+    int v = rs.pool[idx];
+    range_apply_draw(rs, idx, v, ts);
+    return "OK " + to_string(v);
+  }
+  if (cmd == "RRESET") { range_reset(rs); return "OK"; }
+  if (cmd == "RUNDO") return range_undo(rs) ? "OK" : "ERR nothing";
+  if (cmd == "RREDO") return range_redo(rs) ? "OK" : "ERR nothing";
+  if (cmd == "STAT") {
+    return "OK " + to_string(ls.all.size()) + " " + to_string(ls.pool.size()) + " " + to_string(ls.history.size()) +
+           " " + to_string(rs.N) + " " + to_string(rs.pool.size()) + " " + to_string(rs.history.size());
+  }
+  return "ERR unknown";
+}
+
+// write what the socket takes now; the rest waits for EPOLLOUT
+static bool serve_flush(int ep, ServeConn& c) {
+  size_t done = 0;
+  while (done < c.out.size()) {
+    ssize_t w = ::send(c.fd, c.out.data() + done, c.out.size() - done, MSG_NOSIGNAL);
+    if (w < 0 && errno == EINTR) continue;
+    if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+    if (w <= 0) return false;
+    done += (size_t)w;
+  }
+  c.out.erase(0, done);
+  epoll_event ev{};
+  ev.events = EPOLLIN | (c.out.empty() ? 0u : (uint32_t)EPOLLOUT);
+  ev.data.fd = c.fd;
+  epoll_ctl(ep, EPOLL_CTL_MOD, c.fd, &ev);
+  return true;
+}
+
+static int serve(const string& path) {
+  const size_t MAX_LINE = 1 << 20;
+  sockaddr_un addr{};
+  if (path.size() >= sizeof(addr.sun_path)) {
+    cerr << "socket 路徑太長：" << path << "\n";
+    return 1;
+  }
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+  int lfd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (lfd < 0) { perror("socket"); return 1; }
+  ::unlink(path.c_str());
+  if (::bind(lfd, (sockaddr*)&addr, sizeof(addr)) != 0 || ::listen(lfd, SOMAXCONN) != 0) {
+    perror("bind/listen");
+    ::close(lfd);
+    return 1;
+  }
+
+  int ep = epoll_create1(EPOLL_CLOEXEC);
+  epoll_event ev{};
+  ev.events = EPOLLIN;
+  ev.data.fd = lfd;
+  epoll_ctl(ep, EPOLL_CTL_ADD, lfd, &ev);
+
+  signal(SIGINT, serve_on_signal);
+  signal(SIGTERM, serve_on_signal);
+  signal(SIGPIPE, SIG_IGN);
+  cerr << "抽籤服務啟動：" << path << "\n";
+
+  ServeState sv;
+  unordered_map<int, ServeConn> conns;
+  auto drop = [&](int fd) {
+    epoll_ctl(ep, EPOLL_CTL_DEL, fd, nullptr);
+    ::close(fd);
+    conns.erase(fd);
+  };
+
+  vector<epoll_event> events(256);
+  char buf[64 * 1024];
+  while (!g_serveStop) {
+    int n = epoll_wait(ep, events.data(), (int)events.size(), 500);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) { perror("epoll_wait"); break; }
+    for (int i = 0; i < n; i++) {
+      int fd = events[i].data.fd;
+      if (fd == lfd) {
+        while (true) {
+          int cfd = ::accept4(lfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+          if (cfd < 0) break;
+          epoll_event cev{};
+          cev.events = EPOLLIN;
+          cev.data.fd = cfd;
+          epoll_ctl(ep, EPOLL_CTL_ADD, cfd, &cev);
+          conns[cfd].fd = cfd;
+        }
         continue;
       }
+      auto it = conns.find(fd);
+      if (it == conns.end()) continue;
+      ServeConn& c = it->second;
+      bool alive = !(events[i].events & (EPOLLERR | EPOLLHUP)) || (events[i].events & EPOLLIN);
 
-      if (noRepeat) {
-        if (pool.empty()) {
-          ui_header("抽一次", "池子已空，請重置或關閉不重複");
-          rlutil::setColor(rlutil::LIGHTRED);
-          cout << "⚠️ 沒有號碼可抽。\n";
-          rlutil::setColor(rlutil::GREY);
-          pause_anykey();
-          continue;
+      if (alive && (events[i].events & EPOLLIN)) {
+        while (true) {
+          ssize_t r = ::recv(fd, buf, sizeof(buf), 0);
+          if (r > 0) { c.in.append(buf, (size_t)r); continue; }
+          if (r < 0 && errno == EINTR) continue;
+          if (r == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) alive = false;
+          break;
+        }
+        // answer every complete line, in order
+        size_t start = 0, nl;
+        while ((nl = c.in.find('\n', start)) != string::npos) {
+          string_view line(c.in.data() + start, nl - start);
+          if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+          c.out += serve_request(sv, c, line);
+          c.out += '\n';
+          start = nl + 1;
         }
+        c.in.erase(0, start);
+        if (c.in.size() > MAX_LINE) alive = false;
+      }
+      if (alive && !c.out.empty()) alive = serve_flush(ep, c);
+      else if (alive && (events[i].events & EPOLLOUT)) alive = serve_flush(ep, c);
+      if (!alive) drop(fd);
+    }
+  }
 
-        // show animation using N, but final pick must come from pool
-        // We'll animate numbers, then pick from pool uniformly:
-        animated_pick_number(N, rng, "抽籤中（號碼）");
-        uniform_int_distribution<int> dist(0, (int)pool.size() - 1);
-        int idx = dist(rng);
-        int result = pool[idx];
-        pool.erase(pool.begin() + idx);
-        history.push_back(result);
+  for (auto &kv : conns) ::close(kv.first);
+  ::close(ep);
+  ::close(lfd);
+  ::unlink(path.c_str());
+  cerr << "抽籤服務已停止\n";
+  return 0;
+}
+#else
+static int serve(const string& path) {
+  cerr << "--serve 僅支援 Linux：" << path << "\n";
+  return 1;
+}
+#endif
 
-        ui_header("抽籤結果", "恭喜中籤！");
-        rlutil::setColor(rlutil::LIGHTGREEN);
-        cout << "\n🎉 中籤號碼：";
-        rlutil::setColor(rlutil::YELLOW);
-        cout << result << "\n";
-        rlutil::setColor(rlutil::GREY);
-        cout << "剩餘可抽： " << pool.size() << "\n";
+// ---------------------- Sharded coordinator ----------------------
+// `draw --coordinate K --shards a.txt,b.txt,...` draws K winners from a roster
+// partitioned across worker processes, one per shard (forked locally here;
+// each only ever holds its own partition). Workers report their sizes, the
+// coordinator splits K by a multivariate hypergeometric draw, i.e. it runs K
+// draws without replacement over the shard sizes, which also fixes which shard
+// fills each rank, and each worker then draws its share in parallel. Every
+// K-subset of the union is equally likely and the rank order is uniform too.
+// Output: rank \t shard \t name, one per line. POSIX only.
+#ifndef _WIN32
+static bool read_full(int fd, void* p, size_t n) {
+  char* c = (char*)p;
+  while (n > 0) {
+    ssize_t r = ::read(fd, c, n);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return false;
+    c += r;
+    n -= (size_t)r;
+  }
+  return true;
+}
 
-        pause_anykey();
-      } else {
-        int result = animated_pick_number(N, rng, "抽籤中（號碼）");
-        history.push_back(result);
+// one shard: report size, wait for (k, seed), send k winners in draw order
+static int shard_worker(const string& file, int in, int out) {
+  vector<string> names;
+  uint64_t n = read_names_file(file, names) ? (dedup_preserve_order(names), (uint64_t)names.size()) : UINT64_MAX;
+  if (!sys_write_all(out, (const char*)&n, 8) || n == UINT64_MAX) return 1;
+  uint64_t k;
+  uint32_t seed;
+  if (!read_full(in, &k, 8) || !read_full(in, &seed, 4) || k > n) return 1;
 
-        ui_header("抽籤結果", "（此模式允許重複）");
-        rlutil::setColor(rlutil::LIGHTGREEN);
-        cout << "\n🎉 中籤號碼：";
-        rlutil::setColor(rlutil::YELLOW);
-        cout << result << "\n";
-        rlutil::setColor(rlutil::GREY);
-        pause_anykey();
-      }
+  mt19937 rng(seed);
+  string buf;
+  for (uint64_t i = 0; i < k; i++) {
+    size_t j = uniform_int_distribution<size_t>((size_t)i, names.size() - 1)(rng);
+    swap(names[i], names[j]);
+    put_u32(buf, (uint32_t)names[i].size());
+    buf += names[i];
+    if (buf.size() >= (1 << 20)) { if (!sys_write_all(out, buf.data(), buf.size())) return 1; buf.clear(); }
+  }
+  return sys_write_all(out, buf.data(), buf.size()) ? 0 : 1;
+}
+
+static int coordinate(const vector<string>& shards, uint64_t K, uint32_t seed) {
+  struct Worker { pid_t pid; int to, from; uint64_t size = 0, share = 0; };
+  vector<Worker> ws;
+  signal(SIGPIPE, SIG_IGN);  // a failed worker just closes its pipe
+  for (size_t i = 0; i < shards.size(); i++) {
+    int down[2], up[2];
+    if (pipe(down) != 0 || pipe(up) != 0) { perror("pipe"); return 1; }
+    pid_t pid = fork();
+    if (pid < 0) { perror("fork"); return 1; }
+    if (pid == 0) {
+      ::close(down[1]);
+      ::close(up[0]);
+      for (auto &w : ws) { ::close(w.to); ::close(w.from); }
+      _exit(shard_worker(shards[i], down[0], up[1]));
     }
-    else if (op == 4) {
-      ui_header("已抽記錄（號碼）", "由小到大顯示（不改變抽籤順序）");
-      if (history.empty()) {
-        rlutil::setColor(rlutil::DARKGREY);
-        cout << "（尚未抽出）\n";
-        rlutil::setColor(rlutil::GREY);
-      } else {
-        vector<int> tmp = history;
-        sort(tmp.begin(), tmp.end());
-        rlutil::setColor(rlutil::WHITE);
-        for (size_t i = 0; i < tmp.size(); i++) cout << tmp[i] << (i + 1 == tmp.size() ? "\n" : ", ");
-        rlutil::setColor(rlutil::GREY);
+    ::close(down[0]);
+    ::close(up[1]);
+    ws.push_back({pid, down[1], up[0]});
+  }
+
+  bool ok = true;
+  uint64_t total = 0;
+  for (size_t i = 0; i < ws.size(); i++) {
+    if (!read_full(ws[i].from, &ws[i].size, 8) || ws[i].size == UINT64_MAX) {
+      cerr << "分片無法讀取：" << shards[i] << "\n";
+      ok = false;
+    } else {
+      total += ws[i].size;
+    }
+  }
+  if (ok && K > total) {
+    cerr << "總人數只有 " << total << "，無法抽出 " << K << " 位\n";
+    ok = false;
+  }
+
+  // the urn: which shard each rank comes from, drawn without replacement
+  // over the live shard sizes (a Fenwick tree keeps it O(K log shards))
+  vector<uint32_t> rankShard;
+  if (ok) {
+    mt19937_64 rng(seed);
+    size_t S = ws.size();
+    vector<uint64_t> tree(S + 1, 0);
+    for (size_t i = 0; i < S; i++)
+      for (size_t j = i + 1; j <= S; j += j & (~j + 1)) tree[j] += ws[i].size;
+    size_t top = 1;
+    while (top * 2 <= S) top *= 2;
+    rankShard.reserve(K);
+    for (uint64_t r = 0; r < K; r++) {
+      uint64_t u = uniform_int_distribution<uint64_t>(0, total - r - 1)(rng);
+      size_t pos = 0;
+      for (size_t step = top; step; step /= 2) {
+        if (pos + step <= S && tree[pos + step] <= u) { pos += step; u -= tree[pos]; }
       }
-      pause_anykey();
+      rankShard.push_back((uint32_t)pos);
+      ws[pos].share++;
+      for (size_t j = pos + 1; j <= S; j += j & (~j + 1)) tree[j]--;
     }
-    else if (op == 5) {
-      reset_pool();
-      ui_header("已重置", "已清空已抽並重建池子");
-      rlutil::setColor(rlutil::LIGHTGREEN);
-      cout << "N=" << N << " / 可抽=" << (noRepeat ? to_string((int)pool.size()) : string("-")) << "\n";
-      rlutil::setColor(rlutil::GREY);
-      pause_anykey();
+  }
+
+  // every worker gets its share (0 on failure, so it exits) and draws at once
+  seed_seq seq{seed, (uint32_t)shards.size()};
+  vector<uint32_t> seeds(ws.size());
+  seq.generate(seeds.begin(), seeds.end());
+  for (size_t i = 0; i < ws.size(); i++) {
+    uint64_t k = ok ? ws[i].share : 0;
+    sys_write_all(ws[i].to, (const char*)&k, 8);
+    sys_write_all(ws[i].to, (const char*)&seeds[i], 4);
+    ::close(ws[i].to);
+  }
+
+  vector<vector<string>> got(ws.size());
+  for (size_t i = 0; ok && i < ws.size(); i++) {
+    got[i].reserve(ws[i].share);
+    for (uint64_t j = 0; j < ws[i].share && ok; j++) {
+      uint32_t len;
+      string name;
+      ok = read_full(ws[i].from, &len, 4);
+      if (ok) { name.resize(len); ok = read_full(ws[i].from, &name[0], len); }
+      got[i].push_back(move(name));
     }
-    else {
-      rlutil::setColor(rlutil::LIGHTRED);
-      cout << "\n無效選項。\n";
-      rlutil::setColor(rlutil::GREY);
-      pause_anykey();
+    if (!ok) cerr << "分片中斷：" << shards[i] << "\n";
+  }
+  for (auto &w : ws) {
+    ::close(w.from);
+    int status = 0;
+    waitpid(w.pid, &status, 0);
+  }
+  if (!ok) return 1;
+
+  BufferedWriter out;
+  out.open_stdout();
+  vector<size_t> next(ws.size(), 0);
+  for (uint64_t r = 0; r < K; r++) {
+    uint32_t s = rankShard[r];
+    out.put_uint(r + 1);
+    out.put('\t');
+    out.put(shards[s]);
+    out.put('\t');
+    out.put(got[s][next[s]++]);
+    out.put('\n');
+  }
+  out.close();
+  cerr << "已從 " << ws.size() << " 個分片（共 " << total << " 人）抽出 " << K << " 位\n";
+  return out.ok() ? 0 : 1;
+}
+#else
+static int coordinate(const vector<string>&, uint64_t, uint32_t) {
+  cerr << "--coordinate 僅支援 macOS/Linux\n";
+  return 1;
+}
+#endif
+
+// ---------------------- Batch executor ----------------------
+// `draw --batch MANIFEST [--out FILE] [--threads T]` runs many independent
+// draws at once. MANIFEST has one job per line, `roster,count[,seed]`
+// (# starts a comment); each job loads its roster, drops duplicates and draws
+// `count` winners without replacement. Every job owns its RNG, seeded from its
+// own seed (or --seed plus its line number), so results don't depend on
+// scheduling or thread count. A job of ClaimPool::MIN_PARALLEL winners or
+// more is split across the workers, which claim from one shared ClaimPool.
+// Output is one CSV in manifest order:
+//   job,roster,rank,name
+
+// Fixed set of tasks on a work-stealing pool: tasks are dealt round-robin to
+// per-worker deques; a worker pops its own newest task and, when empty,
+// steals the oldest task of another worker.
+class WorkStealingPool {
+public:
+  explicit WorkStealingPool(unsigned threads) : queues_(max(1u, threads)) {}
+
+  void run(vector<function<void()>>& tasks) {
+    for (size_t i = 0; i < tasks.size(); i++) queues_[i % queues_.size()].tasks.push_back(&tasks[i]);
+    vector<thread> workers;
+    for (size_t w = 0; w < queues_.size(); w++) workers.emplace_back([this, w] { work(w); });
+    for (auto &t : workers) t.join();
+  }
+
+private:
+  struct alignas(64) Queue {
+    mutex m;
+    deque<function<void()>*> tasks;
+  };
+
+  function<void()>* pop(size_t w) {
+    Queue& q = queues_[w];
+    lock_guard<mutex> lock(q.m);
+    if (q.tasks.empty()) return nullptr;
+    function<void()>* t = q.tasks.back();
+    q.tasks.pop_back();
+    return t;
+  }
+
+  function<void()>* steal(size_t w) {
+    for (size_t k = 1; k < queues_.size(); k++) {
+      Queue& q = queues_[(w + k) % queues_.size()];
+      lock_guard<mutex> lock(q.m);
+      if (q.tasks.empty()) continue;
+      function<void()>* t = q.tasks.front();
+      q.tasks.pop_front();
+      return t;
+    }
+    return nullptr;
+  }
+
+  // nothing is added after run() starts, so empty everywhere means done
+  void work(size_t w) {
+    while (true) {
+      function<void()>* t = pop(w);
+      if (!t) t = steal(w);
+      if (!t) return;
+      (*t)();
+    }
+  }
+
+  vector<Queue> queues_;
+};
+
+static int run_batch(const string& manifest, const string& outPath, unsigned threads, uint32_t baseSeed) {
+  struct Job {
+    string roster;
+    size_t count = 0;
+    uint32_t seed = 0;
+    vector<string> names, winners;
+    unique_ptr<ClaimPool> claims;
+    vector<size_t> slots;
+    string error;
+  };
+  ifstream fin(manifest);
+  if (!fin) {
+    cerr << "無法開啟工作清單：" << manifest << "\n";
+    return 1;
+  }
+  vector<Job> jobs;
+  string line;
+  for (size_t lineNo = 1; getline(fin, line); lineNo++) {
+    line = trim(line);
+    if (line.empty() || line[0] == '#') continue;
+    stringstream ss(line);
+    string roster, count, seed;
+    getline(ss, roster, ',');
+    getline(ss, count, ',');
+    getline(ss, seed, ',');
+    Job j;
+    j.roster = trim(roster);
+    count = trim(count);
+    seed = trim(seed);
+    // the whole field must be the number (no "5x", no empty, no overflow)
+    auto whole = [](const string& f, auto& v) {
+      auto res = from_chars(f.data(), f.data() + f.size(), v);
+      return !f.empty() && res.ec == errc() && res.ptr == f.data() + f.size();
+    };
+    j.seed = baseSeed + (uint32_t)lineNo;
+    if (j.roster.empty() || !whole(count, j.count) || j.count == 0 || (!seed.empty() && !whole(seed, j.seed))) {
+      cerr << manifest << ":" << lineNo << " 格式應為 roster,count[,seed]\n";
+      return 1;
+    }
+    jobs.push_back(move(j));
+  }
+
+  auto t0 = chrono::steady_clock::now();
+  threads = threads ? threads : max(1u, thread::hardware_concurrency());
+  WorkStealingPool workers(threads);
+
+  // every roster loads on its own worker ...
+  vector<function<void()>> tasks;
+  tasks.reserve(jobs.size());
+  for (auto &job : jobs) {
+    tasks.push_back([&job] {
+      if (!read_names_file(job.roster, job.names)) { job.error = "無法讀取"; return; }
+      dedup_preserve_order(job.names);
+      if (job.count > job.names.size()) job.error = "人數不足（" + to_string(job.names.size()) + "）";
+    });
+  }
+  workers.run(tasks);
+
+  // ... then the draws: small jobs are one partial Fisher-Yates each, large
+  // ones several claimers sharing the job's pool
+  tasks.clear();
+  for (auto &job : jobs) {
+    if (!job.error.empty()) continue;
+    if (job.count < ClaimPool::MIN_PARALLEL) {
+      tasks.push_back([&job] {
+        mt19937 rng(job.seed);
+        vector<string>& names = job.names;
+        for (size_t i = 0; i < job.count; i++) {
+          size_t k = uniform_int_distribution<size_t>(i, names.size() - 1)(rng);
+          swap(names[i], names[k]);
+        }
+        names.resize(job.count);
+        job.winners = move(names);
+      });
+      continue;
+    }
+    mt19937 rng(job.seed);
+    job.claims.reset(new ClaimPool(job.names.size(), job.count, rng));
+    job.slots.resize(job.count);
+    job.winners.resize(job.count);
+    size_t parts = min<size_t>(threads, job.count / ClaimPool::MIN_PARALLEL);
+    for (size_t p = 0; p < parts; p++) {
+      tasks.push_back([&job] {
+        size_t slot, ticket;
+        while (job.claims->claim(slot, ticket)) {
+          job.slots[ticket] = slot;
+          job.winners[ticket] = job.names[slot];
+        }
+      });
+    }
+  }
+  workers.run(tasks);
+  for (auto &job : jobs) {
+    if (job.claims && !slots_distinct(job.slots, job.names.size())) job.error = "同一位置被抽出兩次";
+    job.names = vector<string>();
+  }
+
+  BufferedWriter out;
+  if (outPath.empty() ? !out.open_stdout() : !out.open(outPath, false)) {
+    cerr << "無法寫入：" << outPath << "\n";
+    return 1;
+  }
+  out.put("job,roster,rank,name\n");
+  size_t failed = 0, rows = 0;
+  for (size_t i = 0; i < jobs.size(); i++) {
+    if (!jobs[i].error.empty()) {
+      cerr << "工作 " << (i + 1) << "（" << jobs[i].roster << "）：" << jobs[i].error << "\n";
+      failed++;
+      continue;
+    }
+    for (size_t r = 0; r < jobs[i].winners.size(); r++) {
+      out.put_uint(i + 1);
+      out.put(',');
+      out.put(jobs[i].roster);
+      out.put(',');
+      out.put_uint(r + 1);
+      out.put(',');
+      out.put(jobs[i].winners[r]);
+      out.put('\n');
+      rows++;
     }
   }
+  bool ok = out.close();
+  double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - t0).count();
+  cerr << "完成 " << (jobs.size() - failed) << "/" << jobs.size() << " 個工作，共 " << rows << " 筆，"
+       << (long)ms << " ms\n";
+  return ok && failed == 0 ? 0 : 1;
 }
 
 // ---------------------- Main ----------------------
-int main() {
+int main(int argc, char** argv) {
   setup_console_utf8();
 
   // Avoid "black screen" / buffering confusion
   ios::sync_with_stdio(true);
   cin.tie(&cout);
 
-  mt19937 rng((unsigned)time(nullptr));
+  string journalPath = "draw.journal";
+  string snapshotPath = "draw.snapshot";
+  string mmapPrefix;
+  uint32_t msyncEvery = 64;
+  bool useJournal = true;
+  bool resume = false;
+  bool haveSeed = false;
+  uint32_t seed = 0;
+  size_t poolAt = 0, rangePoolAt = 0;
+  string registryPrefix;
+  string servePath;
+  string sharedName = "draw";
+  uint64_t coordinateK = 0;
+  vector<string> shardFiles;
+  string batchManifest, batchOut;
+  unsigned batchThreads = 0;
+  double fairHalfLife = 0;
+  for (int i = 1; i < argc; i++) {
+    string a = argv[i];
+    if (a == "--journal" && i + 1 < argc) journalPath = argv[++i];
+    else if (a == "--no-journal") useJournal = false;
+    else if (a == "--snapshot" && i + 1 < argc) snapshotPath = argv[++i];
+    else if (a == "--resume") resume = true;
+    else if (a == "--mmap-state" && i + 1 < argc) mmapPrefix = argv[++i];
+    else if (a == "--msync-every" && i + 1 < argc) msyncEvery = (uint32_t)max(0, atoi(argv[++i]));
+    else if (a == "--seed" && i + 1 < argc) { seed = (uint32_t)strtoul(argv[++i], nullptr, 10); haveSeed = true; }
+    else if (a == "--pool-at" && i + 1 < argc) poolAt = strtoull(argv[++i], nullptr, 10);
+    else if (a == "--range-pool-at" && i + 1 < argc) rangePoolAt = strtoull(argv[++i], nullptr, 10);
+    else if (a == "--registry" && i + 1 < argc) registryPrefix = argv[++i];
+    else if (a == "--serve" && i + 1 < argc) servePath = argv[++i];
+    else if (a == "--shared" && i + 1 < argc) sharedName = argv[++i];
+    else if (a == "--batch" && i + 1 < argc) batchManifest = argv[++i];
+    else if (a == "--out" && i + 1 < argc) batchOut = argv[++i];
+    else if (a == "--threads" && i + 1 < argc) batchThreads = (unsigned)max(0, atoi(argv[++i]));
+    else if (a == "--coordinate" && i + 1 < argc) {
+      string k = argv[++i];
+      auto res = from_chars(k.data(), k.data() + k.size(), coordinateK);
+      if (res.ec != errc() || res.ptr != k.data() + k.size() || coordinateK == 0) {
+        cerr << "--coordinate 的人數無效：" << k << "\n";
+        return 2;
+      }
+    }
+    else if (a == "--shards" && i + 1 < argc) {
+      stringstream list(argv[++i]);
+      for (string f; getline(list, f, ',');) if (!f.empty()) shardFiles.push_back(f);
+    }
+    else if (a == "--fair-halflife" && i + 1 < argc) fairHalfLife = atof(argv[++i]);
+    else {
+      cerr << "用法：draw [--resume] [--snapshot PATH] [--journal PATH] [--no-journal]\n"
+              "            [--mmap-state PREFIX] [--msync-every K] [--seed S]\n"
+              "            [--registry PREFIX [--fair-halflife DAYS]] [--shared NAME]\n"
+              "       draw --serve SOCKET   （本機抽籤服務，Linux）\n"
+              "       draw --coordinate K --shards a.txt,b.txt,... [--seed S]   （分片抽出 K 位）\n"
+              "       draw --batch MANIFEST [--out FILE] [--threads T] [--seed S]   （批次抽籤）\n"
+              "            [--pool-at K | --range-pool-at K]   （從快照唯讀查詢第 K 次抽籤前的池子）\n";
+      return 2;
+    }
+  }
+  if (!servePath.empty()) return serve(servePath);
+  if (!batchManifest.empty()) return run_batch(batchManifest, batchOut, batchThreads, haveSeed ? seed : (uint32_t)time(nullptr));
+  if (coordinateK || !shardFiles.empty()) {
+    if (shardFiles.empty()) { cerr << "--coordinate 需要 --shards\n"; return 2; }
+    return coordinate(shardFiles, coordinateK, haveSeed ? seed : (uint32_t)time(nullptr));
+  }
+
+  Session session;
+  session.seed = haveSeed ? seed : (uint32_t)time(nullptr);
+  session.rng.seed(session.seed);
+  Journal journal;
+
+  if (!mmapPrefix.empty()) {
+    if (!range_attach(session.range, mmapPrefix, msyncEvery)) {
+      cerr << "無法使用記憶體映射狀態檔：" << mmapPrefix << ".pool / .hist\n";
+      return 1;
+    }
+    journal.skipRange = true;
+  }
+
+  // headless time-travel query: print the pool before draw #K, one per line.
+  // Read-only: the saved session comes straight from the snapshot (its undo
+  // log included), and the journal is neither replayed nor opened.
+  if (poolAt || rangePoolAt) {
+    if (ifstream(snapshotPath).good() && snapshot_load(snapshotPath, session) == 0) {
+      cerr << "無法讀取快照：" << snapshotPath << "\n";
+      return 1;
+    }
+    list_ready(session);
+    ifstream pending(journalPath, ios::binary | ios::ate);
+    if (useJournal && pending && pending.tellg() > 8)
+      cerr << "注意：" << journalPath << " 還有未存進快照的紀錄（上次未正常結束），查詢不含這些\n";
+    size_t k = poolAt ? poolAt : rangePoolAt;
+    size_t drawn = poolAt ? session.list.history.size() : session.range.history.size();
+    if (k > drawn) {
+      cerr << "只有 " << drawn << " 次抽籤紀錄\n";
+      return 1;
+    }
+    BufferedWriter out;
+    out.open_stdout();
+    bool exact;
+    size_t count;
+    if (poolAt) {
+      PoolAt<string> at = list_pool_at(session.list, k);
+      at.for_each(session.list.pool, [&](const string& x) { out.put(x); out.put('\n'); });
+      exact = at.exact;
+      count = at.count;
+    } else {
+      PoolAt<int> at = range_pool_at(session.range, k);
+      at.for_each(session.range.pool, [&](int x) { put_int(out, x); out.put('\n'); });
+      exact = at.exact;
+      count = at.count;
+    }
+    bool ok = out.close();
+    cerr << "第 " << k << " 次抽籤前：" << count << (exact ? "" : "（不完整：早於操作紀錄）") << "\n";
+    return ok ? 0 : 1;
+  }
+
+  Registry registry;
+  if (!registryPrefix.empty() && !registry.open(registryPrefix)) {
+    cerr << "無法開啟歷屆中籤紀錄：" << registryPrefix << ".log / .idx\n";
+    return 1;
+  }
+  if (fairHalfLife > 0) {
+    registry.policy = PAST_WEIGHT;
+    registry.halfLifeDays = fairHalfLife;
+  }
+
+  long replayed = 0;
+  if (useJournal) {
+    replayed = journal_replay(journalPath, session);
+    if (replayed < 0) {
+      cerr << "日誌格式不符，請移除或改用 --journal 指定其他檔案：" << journalPath << "\n";
+      return 1;
+    }
+    if (!journal.open(journalPath)) {
+      cerr << "無法開啟日誌：" << journalPath << "\n";
+      return 1;
+    }
+    if (replayed > 0) {
+      list_ready(session);
+      ui_header("已從日誌復原", "上次未正常結束，已重播 " + to_string(replayed) + " 筆紀錄");
+      cout << "模式 A：全部 " << session.list.all.size() << " 人 / 可抽 " << session.list.pool.size()
+           << " 人 / 已抽 " << session.list.history.size() << " 人\n";
+      cout << "模式 B：N=" << session.range.N << " / 已抽 " << session.range.history.size() << "\n";
+      pause_anykey();
+    }
+  }
+
+  if (resume && replayed <= 0) {
+    uint64_t id = snapshot_load(snapshotPath, session);
+    if (id == 0) {
+      cerr << "無法讀取快照：" << snapshotPath << "\n";
+      return 1;
+    }
+    journal.log_snapshot_base(id, snapshotPath);
+    journal.commit();
+  }
 
   while (true) {
     ui_header("主選單", "選擇你要的抽籤模式");
     ui_menu({
       "1) 模式 A：名單抽籤（不重複、可讀檔/手動、可匯出）",
       "2) 模式 B：範圍抽籤（1~N、不重複可切換）",
+      "3) 模式 C：共享池（多台終端同時抽、不重複）",
+      "4) 模式 D：隨機分組（平均分組、可依部門分層）",
       "0) 離開"
     });
 
@@ -544,14 +5772,50 @@ int main() {
     cin >> op;
 
     if (op == 0) break;
-    if (op == 1) mode_list_draw(rng);
-    else if (op == 2) mode_range_draw(rng);
+    if (op == 1) mode_list_draw(session, journal, registry);
+    else if (op == 2) mode_range_draw(session, journal);
+    else if (op == 3) mode_shared_draw(session, sharedName);
+    else if (op == 4) mode_group_draw(session);
     else pause_anykey("無效選項，按任意鍵返回...");
   }
 
+  // A snapshot this run didn't resume from holds some earlier session: an
+  // untouched session leaves it alone, anything else asks before replacing it.
+  string savePath = snapshotPath;
+  if (session.snapshotId == 0 && ifstream(snapshotPath).good()) {
+    bool untouched = session.list.all.empty() && session.range.N == 0 && session.range.history.empty();
+    int op = 0;
+    if (!untouched) {
+      ui_header("儲存工作階段", "已有快照 " + snapshotPath + "，但本次沒有用 --resume 載入");
+      ui_menu({
+        "1) 覆寫這個快照",
+        "2) 另存為新的快照檔",
+        "0) 不儲存本次工作階段"
+      });
+      if (!(cin >> op)) op = 2;  // no answer: never throw either session away
+    }
+    if (op == 0) {
+      savePath.clear();
+    } else if (op != 1) {
+      cout << "快照檔名（例如 draw2.snapshot）： " << flush;
+      string name;
+      if (!(cin >> name) || name == snapshotPath) name = snapshotPath + "." + to_string(now_unix_ms());
+      savePath = name;
+    }
+  }
+
+  string note;
+  if (savePath.empty()) journal.discard();
+  else if (snapshot_save(savePath, session) != 0) {
+    journal.discard();
+    if (savePath != snapshotPath) note = "已另存快照：" + savePath + "（下次用 --resume --snapshot " + savePath + " 載入）";
+  }
+  else note = "快照寫入失敗，保留日誌：" + journalPath;
+
   rlutil::cls();
   rlutil::setColor(rlutil::LIGHTCYAN);
   cout << "程式結束。\n";
   rlutil::setColor(rlutil::GREY);
+  if (!note.empty()) cerr << note << "\n";
   return 0;
 }